@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+// Bump allocator for data that lives exactly as long as one parsed label: field text, comments and graphic bitmaps.
+// reset() only rewinds the cursor, the blocks are kept, so once they have grown to fit the largest label no further
+// heap allocations are made no matter how many labels are parsed
+class Arena {
+public:
+    Arena(size_t block_size = 4 * 1024) : block_size(block_size) {}
+
+    // Uninitialized memory aligned to 8 bytes, valid until the next reset
+    void* allocate(size_t size) {
+        size = (size + 7) & ~(size_t) 7;
+        while (block < blocks.size()) {
+            if (used + size <= blocks[block].size) {
+                void* result = blocks[block].data.get() + used;
+                used += size;
+                return result;
+            }
+            // Continue in the next kept block
+            block++;
+            used = 0;
+        }
+        // Every kept block is full, a new one twice the size of the last fits at least this allocation
+        size_t capacity = std::max(size, blocks.empty() ? block_size : blocks.back().size * 2);
+        blocks.push_back({ std::unique_ptr<uint8_t[]>(new uint8_t[capacity]), capacity });
+        used = size;
+        return blocks[block].data.get();
+    }
+
+    uint8_t* zeroed(size_t size) {
+        uint8_t* result = (uint8_t*) allocate(size);
+        memset(result, 0, size);
+        return result;
+    }
+
+    // Zero terminated copy of length bytes
+    char* copy(const char* str, size_t length) {
+        char* result = (char*) allocate(length + 1);
+        memcpy(result, str, length);
+        result[length] = '\0';
+        return result;
+    }
+
+    void reset() {
+        block = 0;
+        used = 0;
+    }
+
+    // Bytes held by the kept blocks
+    size_t capacity() const {
+        size_t total = 0;
+        for (const Block& b : blocks) total += b.size;
+        return total;
+    }
+
+private:
+    struct Block {
+        std::unique_ptr<uint8_t[]> data;
+        size_t size;
+    };
+
+    size_t block_size;
+    std::vector<Block> blocks;
+    size_t block = 0; // Block being filled
+    size_t used = 0; // Bytes taken from it
+};
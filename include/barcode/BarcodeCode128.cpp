@@ -103,9 +103,9 @@ namespace BC_C128 {
 
 	int Barcode_128b_encode(struct Barcode_Item* bc)
 	{
-		static char* text;
-		static char* partial;  /* dynamic */
-		static char* textinfo; /* dynamic */
+		char* text;
+		char* partial;  /* dynamic */
+		char* textinfo; /* dynamic */
 		char* textptr;
 		int i, code, textpos, checksum = 0;
 
@@ -190,9 +190,9 @@ namespace BC_C128 {
 	}
 
 	int Barcode_128c_encode(struct Barcode_Item* bc) {
-		static char* text;
-		static char* partial;  /* dynamic */
-		static char* textinfo; /* dynamic */
+		char* text;
+		char* partial;  /* dynamic */
+		char* textinfo; /* dynamic */
 		char* textptr;
 		int i, code, textpos, checksum = 0;
 
@@ -448,9 +448,9 @@ namespace BC_C128 {
 	 */
 	int Barcode_128_encode(struct Barcode_Item* bc)
 	{
-		static char* text;
-		static char* partial;  /* dynamic */
-		static char* textinfo; /* dynamic */
+		char* text;
+		char* partial;  /* dynamic */
+		char* textinfo; /* dynamic */
 		char* textptr;
 		int* codes; /* dynamic */
 		int i, c, len;
@@ -558,9 +558,9 @@ namespace BC_C128 {
 
 	int Barcode_128raw_encode(struct Barcode_Item* bc)
 	{
-		static char* text;
-		static char* partial;  /* dynamic */
-		static char* textinfo; /* dynamic */
+		char* text;
+		char* partial;  /* dynamic */
+		char* textinfo; /* dynamic */
 		char* textptr;
 		int i, n, count, code, textpos, checksum = 0;
 
@@ -639,7 +639,7 @@ namespace BC_C128 {
 
 		return 0;
 	}
-	struct Barcode_Item bc;
+	thread_local struct Barcode_Item bc; // Barcodes of separate bands are encoded concurrently
 }
 
 
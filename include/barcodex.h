@@ -5,6 +5,7 @@
 // #define HAVE_QRENCODE 1
 
 #include "imagex.h"
+#include "vectorx.h"
 #include "draw_utils.h"
 #include "./barcode/BarcodeCode128.h"
 #include "./barcode/RendererCustom.h"
@@ -19,7 +20,8 @@ struct RenderStateTemp {
     float scale_x = 0;
     float scale_y = 0;
     bool inverted = false;
-} rst;
+};
+thread_local RenderStateTemp rst; // Barcodes of separate bands are rendered concurrently
 
 // #define DEBUG_DRAWING
 
@@ -109,27 +111,182 @@ void barcode_render_setup(RendererCustom* renderer, Image* image, float x, float
 }
 
 
-void ImageDrawBarcode_Code39(Image* image, const char* text, int x, int y, int height, int scale, bool show_text, bool checksum, bool inverted) {
-#ifdef DEBUG_DRAWING
-    printf("Drawing barcode Code39 at %d, %d with message %s\n", x, y, text);
-    printf("  Height: %d, Scale: %d, Show Text: %d, Checksum: %d\n", height, scale, show_text, checksum);
-#endif
-    if (!image) {
-        notifyf("Error: Image is null\n");
-        return;
+// Bounds of everything a barcode draws, collected by rendering it with the measuring callbacks
+struct BarcodeBounds {
+    int x0 = 0;
+    int y0 = 0;
+    int x1 = 0;
+    int y1 = 0;
+    bool empty = true;
+    void add(int ax0, int ay0, int ax1, int ay1) {
+        if (ax0 >= ax1 || ay0 >= ay1) return;
+        if (empty) {
+            x0 = ax0;
+            y0 = ay0;
+            x1 = ax1;
+            y1 = ay1;
+            empty = false;
+            return;
+        }
+        x0 = std::min(x0, ax0);
+        y0 = std::min(y0, ay0);
+        x1 = std::max(x1, ax1);
+        y1 = std::max(y1, ay1);
     }
+};
+thread_local BarcodeBounds rsb;
+
+void barcode_measureRect(double x, double y, double w, double h) {
+    // Same integer conversion as drawRect
+    int ix = x * rst.scale_x + rst.x;
+    int iy = y * rst.scale_y + rst.y;
+    int iw = w * rst.scale_x;
+    int ih = h * rst.scale_y;
+    rsb.add(ix, iy, ix + iw, iy + ih);
+}
+
+void barcode_measureText(double x, double y, double size, const char* text) {
+    int ix = x * rst.scale_x + rst.x;
+    int iy = y * rst.scale_y + rst.y;
+    int is = size * rst.scale_x;
+    int x0, y0, x1, y1;
+    if (Image::measureText(ix, iy, is, text, "Helvetica", x0, y0, x1, y1)) rsb.add(x0, y0, x1, y1);
+}
+
+void barcode_measureRing(double x, double y, double r, double w) {
+    int ix = x * rst.scale_x + rst.x;
+    int iy = y * rst.scale_y + rst.y;
+    int ir = r * rst.scale_x;
+    rsb.add(ix - ir, iy - ir, ix + ir + 1, iy + ir + 1);
+}
+
+void barcode_measureHexagon(double x, double y, double h) {
+    float ix = x * rst.scale_x + rst.x;
+    float iy = y * rst.scale_y + rst.y;
+    float ih = h * rst.scale_x;
+    rsb.add(floorf(ix - ih), floorf(iy - ih), ceilf(ix + ih) + 1, ceilf(iy + ih) + 1);
+}
+
+void barcode_measure_setup(RendererCustom* renderer, float x, float y, float scale_x, float scale_y) {
+    if (!renderer) return;
+    rst.image = nullptr;
+    rst.x = x;
+    rst.y = y;
+    rst.scale_x = scale_x;
+    rst.scale_y = scale_y;
+    rst.inverted = false;
+    rsb = BarcodeBounds();
+    renderer->setDrawBeginFunction(&barcode_drawBegin);
+    renderer->setDrawEndFunction(&barcode_drawEnd);
+    renderer->setDrawLineFunction(&barcode_measureRect);
+    renderer->setDrawBoxFunction(&barcode_measureRect);
+    renderer->setDrawTextFunction(&barcode_measureText);
+    renderer->setDrawRingFunction(&barcode_measureRing);
+    renderer->setDrawHexagonFunction(&barcode_measureHexagon);
+}
+
+
+thread_local VectorWriter* rsv = nullptr; // Writer the barcode is drawn into by the vector callbacks
+
+void barcode_vectorRect(double x, double y, double w, double h) {
+    // Same integer conversion as drawRect
+    int ix = x * rst.scale_x + rst.x;
+    int iy = y * rst.scale_y + rst.y;
+    int iw = w * rst.scale_x;
+    int ih = h * rst.scale_y;
+    rsv->rect(ix, iy, iw, ih, 0, 0, false, rst.inverted);
+}
+
+void barcode_vectorText(double x, double y, double size, const char* text) {
+    int ix = x * rst.scale_x + rst.x;
+    int iy = y * rst.scale_y + rst.y;
+    int is = size * rst.scale_x;
+    rsv->text(ix, iy, is, text, "Helvetica", false, rst.inverted);
+}
+
+void barcode_vectorRing(double x, double y, double r, double w) {
+    float ix = x * rst.scale_x + rst.x;
+    float iy = y * rst.scale_y + rst.y;
+    float ir = r * rst.scale_x;
+    rsv->ellipse(ix, iy, ir, ir, std::max(1.0, w * rst.scale_x), false, rst.inverted);
+}
+
+void barcode_vectorHexagon(double x, double y, double h) {
+    float ix = x * rst.scale_x + rst.x;
+    float iy = y * rst.scale_y + rst.y;
+    float ih = h * rst.scale_x;
+    // Same corners as ImageDrawNGon
+    double points[12];
+    for (int i = 0; i < 6; i++) {
+        points[i * 2] = ix + cosf(i * 60 * DEG2RAD) * ih;
+        points[i * 2 + 1] = iy + sinf(i * 60 * DEG2RAD) * ih;
+    }
+    rsv->polygon(points, 6, false, rst.inverted);
+}
+
+void barcode_vector_setup(RendererCustom* renderer, VectorWriter* writer, float x, float y, float scale_x, float scale_y, bool inverted) {
+    if (!renderer) return;
+    if (!writer) return;
+    rsv = writer;
+    rst.image = nullptr;
+    rst.x = x;
+    rst.y = y;
+    rst.scale_x = scale_x;
+    rst.scale_y = scale_y;
+    rst.inverted = inverted;
+    renderer->setDrawBeginFunction(&barcode_drawBegin);
+    renderer->setDrawEndFunction(&barcode_drawEnd);
+    renderer->setDrawLineFunction(&barcode_vectorRect);
+    renderer->setDrawBoxFunction(&barcode_vectorRect);
+    renderer->setDrawTextFunction(&barcode_vectorText);
+    renderer->setDrawRingFunction(&barcode_vectorRing);
+    renderer->setDrawHexagonFunction(&barcode_vectorHexagon);
+}
+
+
+Barcode* BuildBarcode_Code39(const char* text, int height, bool show_text, bool checksum) {
     if (!text) {
         notifyf("Error: Text is null\n");
-        return;
+        return nullptr;
     }
     // Create barcode object
     Barcode* bc = BarcodeCode39::create();
     if (!bc) {
         notifyf("Error: Barcode is undefined\n");
-        return;
+        return nullptr;
     }
     // Set barcode options
     bc->setChecksum(checksum).setShowText(show_text).build(text, 0, height);
+    return bc;
+}
+
+Barcode* BuildBarcode_Code128(const char* text, int height, bool show_text, char mode) {
+    if (!text) {
+        notifyf("Error: Text is null\n");
+        return nullptr;
+    }
+    // Create barcode object
+    Barcode* bc = BarcodeCode128::create();
+    if (!bc) {
+        notifyf("Error: Barcode is undefined\n");
+        return nullptr;
+    }
+    // Set barcode options
+    bc->setShowText(show_text).setMode(mode).build(text, 0, height);
+    return bc;
+}
+
+void ImageDrawBarcode_Code39(Image* image, const char* text, int x, int y, int height, int scale, bool show_text, bool checksum, bool inverted) {
+#ifdef DEBUG_DRAWING
+    printf("Drawing barcode Code39 at %d, %d with message %s\n", x, y, text);
+    printf("  Height: %d, Scale: %d, Show Text: %d, Checksum: %d\n", height, scale, show_text, checksum);
+#endif
+    if (!image) {
+        notifyf("Error: Image is null\n");
+        return;
+    }
+    Barcode* bc = BuildBarcode_Code39(text, height, show_text, checksum);
+    if (!bc) return;
 
     float scale_x = ((float) scale) * 1.4f;
     float scale_y = 1; //((float) height) * 0.05f;
@@ -152,18 +309,8 @@ void ImageDrawBarcode_Code128(Image* image, const char* text, int x, int y, int
         notifyf("Error: Image is null\n");
         return;
     }
-    if (!text) {
-        notifyf("Error: Text is null\n");
-        return;
-    }
-    // Create barcode object
-    Barcode* bc = BarcodeCode128::create();
-    if (!bc) {
-        notifyf("Error: Barcode is undefined\n");
-        return;
-    }
-    // Set barcode options
-    bc->setShowText(show_text).setMode(mode).build(text, 0, height);
+    Barcode* bc = BuildBarcode_Code128(text, height, show_text, mode);
+    if (!bc) return;
 
     float scale_x = ((float) scale) * 1.0f;
     float scale_y = 1; //((float) height) * 0.05f;
@@ -175,4 +322,53 @@ void ImageDrawBarcode_Code128(Image* image, const char* text, int x, int y, int
     bc->render(renderer);
     // Cleanup
     delete bc;
-}
\ No newline at end of file
+}
+
+// Bounds [x0, x1) x [y0, y1) of the pixels ImageDrawBarcode_Code39 draws, false when it draws nothing
+bool MeasureBarcode_Code39(const char* text, int x, int y, int height, int scale, bool show_text, bool checksum, int& x0, int& y0, int& x1, int& y1) {
+    Barcode* bc = BuildBarcode_Code39(text, height, show_text, checksum);
+    if (!bc) return false;
+    RendererCustom renderer;
+    barcode_measure_setup(&renderer, x, y, ((float) scale) * 1.4f, 1);
+    bc->render(renderer);
+    delete bc;
+    x0 = rsb.x0;
+    y0 = rsb.y0;
+    x1 = rsb.x1;
+    y1 = rsb.y1;
+    return !rsb.empty;
+}
+
+// Bounds [x0, x1) x [y0, y1) of the pixels ImageDrawBarcode_Code128 draws, false when it draws nothing
+bool MeasureBarcode_Code128(const char* text, int x, int y, int height, int scale, bool show_text, char mode, int& x0, int& y0, int& x1, int& y1) {
+    Barcode* bc = BuildBarcode_Code128(text, height, show_text, mode);
+    if (!bc) return false;
+    RendererCustom renderer;
+    barcode_measure_setup(&renderer, x, y, ((float) scale) * 1.0f, 1);
+    bc->render(renderer);
+    delete bc;
+    x0 = rsb.x0;
+    y0 = rsb.y0;
+    x1 = rsb.x1;
+    y1 = rsb.y1;
+    return !rsb.empty;
+}
+
+// Vector counterparts of ImageDrawBarcode_Code39 and ImageDrawBarcode_Code128, same placement and scale
+void VectorDrawBarcode_Code39(VectorWriter* writer, const char* text, int x, int y, int height, int scale, bool show_text, bool checksum, bool inverted) {
+    Barcode* bc = BuildBarcode_Code39(text, height, show_text, checksum);
+    if (!bc) return;
+    RendererCustom renderer;
+    barcode_vector_setup(&renderer, writer, x, y, ((float) scale) * 1.4f, 1, inverted);
+    bc->render(renderer);
+    delete bc;
+}
+
+void VectorDrawBarcode_Code128(VectorWriter* writer, const char* text, int x, int y, int height, int scale, bool show_text, char mode, bool inverted) {
+    Barcode* bc = BuildBarcode_Code128(text, height, show_text, mode);
+    if (!bc) return;
+    RendererCustom renderer;
+    barcode_vector_setup(&renderer, writer, x, y, ((float) scale) * 1.0f, 1, inverted);
+    bc->render(renderer);
+    delete bc;
+}
@@ -56,20 +56,23 @@ void ImageDrawRectangleRoundedLinesEx(Image* dst, struct Rectangle rec, float ro
 
 
 void ImageDrawQuadrilateral(Image* dst, Vector2 v1, Vector2 v2, Vector2 v3, Vector2 v4, Color color, bool inverted = false) {
-    dst->drawTriangle(v1, v2, v3, 0, BLANK, color, inverted);
-    dst->drawTriangle(v1, v3, v4, 0, BLANK, color, inverted);
+    const Vector2 points[4] = { v1, v2, v3, v4 };
+    dst->fillPolygon(points, 4, color, inverted);
 }
 
 void ImageDrawNGon(Image* dst, Vector2 center, float radius, int sides, Color color, bool inverted = false) {
     if (sides < 3) return;
     float step = 360.0f / sides;
-    Vector2* points = (Vector2*) malloc(sides * sizeof(Vector2));
+    Vector2 stack_points[16];
+    std::vector<Vector2> heap_points;
+    Vector2* points = stack_points;
+    if (sides > 16) {
+        heap_points.resize(sides);
+        points = heap_points.data();
+    }
     for (int i = 0; i < sides; i++) {
         points[i].x = center.x + cosf(i * step * DEG2RAD) * radius;
         points[i].y = center.y + sinf(i * step * DEG2RAD) * radius;
-        if (i > 0) {
-            dst->drawTriangle(center, points[i - 1], points[i], 0, BLANK, color, inverted);
-        }
     }
-    free(points);
+    dst->fillPolygon(points, sides, color, inverted);
 }
@@ -43,17 +43,27 @@ const std::string b64encode(const void* data, const size_t &len)
     return result;
 }
 
-const std::string b64decode(const void* data, const size_t &len)
+// Size of the decoded data, the buffer given to b64decode needs this many bytes
+size_t b64decodedLength(const void* data, const size_t &len)
 {
-    if (len == 0) return "";
+    if (len == 0) return 0;
+    unsigned char *p = (unsigned char*) data;
+    size_t pad1 = len % 4 || p[len - 1] == '=',
+        pad2 = pad1 && (len % 4 > 2 || p[len - 2] != '=');
+    const size_t last = (len - pad1) / 4 << 2;
+    return last / 4 * 3 + pad1 + pad2;
+}
+
+// Decode into str, which holds at least b64decodedLength bytes
+void b64decode(const void* data, const size_t &len, unsigned char* str)
+{
+    if (len == 0) return;
 
     unsigned char *p = (unsigned char*) data;
     size_t j = 0,
         pad1 = len % 4 || p[len - 1] == '=',
         pad2 = pad1 && (len % 4 > 2 || p[len - 2] != '=');
     const size_t last = (len - pad1) / 4 << 2;
-    std::string result(last / 4 * 3 + pad1 + pad2, '\0');
-    unsigned char *str = (unsigned char*) &result[0];
 
     for (size_t i = 0; i < last; i += 4)
     {
@@ -72,6 +82,12 @@ const std::string b64decode(const void* data, const size_t &len)
             str[j++] = n >> 8 & 0xFF;
         }
     }
+}
+
+const std::string b64decode(const void* data, const size_t &len)
+{
+    std::string result(b64decodedLength(data, len), '\0');
+    b64decode(data, len, (unsigned char*) &result[0]);
     return result;
 }
 
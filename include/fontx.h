@@ -2,6 +2,7 @@
 
 #include "tools.h"
 #include <map>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <stdexcept>
@@ -23,6 +24,17 @@ const int ttf_fonts_count = sizeof(ttf_fonts) / sizeof(ttf_fonts[0]);
 
 
 class FontLib_t {
+public:
+    // Rendered glyph, kept so text can be drawn from several threads without touching FreeType
+    struct Glyph {
+        int left = 0;
+        int top = 0;
+        int advance = 0;
+        int width = 0;
+        int rows = 0;
+        std::vector<uint8_t> buffer; // width x rows coverage values
+    };
+
 private:
     struct Font {
         std::string name;
@@ -38,6 +50,9 @@ private:
     int fontSize = 12;
     bool monochrome = false; // Doesn't work correctly
 
+    std::recursive_mutex mutex; // FreeType faces and the selected font are shared state
+    std::map<std::pair<const Font*, int>, Glyph> glyphCache; // (font, size << 8 | char)
+
 public:
     FontLib_t() {
         if (FT_Init_FreeType(&ftLibrary)) {
@@ -53,6 +68,7 @@ public:
     }
 
     int loadFont(const char* name, const char* data, size_t length) {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
         if (fontTable.size() >= maxFonts) {
             notifyf("loadFont: Maximum number of fonts loaded, unable to load '%s'\n", name);
             return -1; // Maximum number of fonts loaded
@@ -80,6 +96,7 @@ public:
     }
 
     int setFont(const char* name, int font_size = 0) {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
         if (font_size > 0) fontSize = font_size;
         auto it = fontTable.find(name);
         if (it == fontTable.end()) {
@@ -107,7 +124,9 @@ public:
         return 0; // Success
     }
 
+    // The returned slot is overwritten by the next glyph that is loaded, use getGlyph when drawing from several threads
     FT_GlyphSlot* getChar(char c, const char* name, int font_size) {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
         if (name != nullptr) {
             setFont(name, font_size);
         }
@@ -130,7 +149,31 @@ public:
         return &selectedFont->face->glyph;
     }
 
+    const Glyph* getGlyph(char c, const char* name, int font_size) {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        if (setFont(name, font_size)) return nullptr;
+        std::pair<const Font*, int> key(selectedFont, (font_size << 8) | (uint8_t) c);
+        auto it = glyphCache.find(key);
+        if (it != glyphCache.end()) return &it->second;
+        FT_GlyphSlot* slot = getChar(c, nullptr, font_size);
+        if (!slot) return nullptr;
+        FT_GlyphSlot& g = slot[0];
+        Glyph& glyph = glyphCache[key];
+        glyph.left = g->bitmap_left;
+        glyph.top = g->bitmap_top;
+        glyph.advance = g->advance.x >> 6;
+        glyph.width = g->bitmap.width;
+        glyph.rows = g->bitmap.rows;
+        glyph.buffer.resize((size_t) glyph.width * glyph.rows);
+        int pitch = g->bitmap.pitch < 0 ? -g->bitmap.pitch : g->bitmap.pitch;
+        for (int iy = 0; iy < glyph.rows; iy++) {
+            memcpy(&glyph.buffer[(size_t) iy * glyph.width], g->bitmap.buffer + (size_t) iy * pitch, glyph.width);
+        }
+        return &glyph;
+    }
+
     int getWidth(const char* name, const char* text, int length) {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
         auto it = fontTable.find(name);
         if (it == fontTable.end()) {
             notifyf("getWidth: Font not found '%s'\n", name);
@@ -2,6 +2,7 @@
 
 #define _CRT_SECURE_NO_WARNINGS
 
+#include <algorithm>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -17,74 +18,105 @@
 #include "colorx.h"
 #include "lodepng.h"
 #include "fpng.h"
+#include "pngx.h"
+#include "rasterx.h"
 #include "fontx.h"
 
-enum PNG_ENCODER {
-    PE_UNKNOWN,
-    PE_LODEPNG,
-    PE_FPNG,
-};
-
-enum FPNG_FLAGS {
-    // Enables computing custom Huffman tables for each file, instead of using the custom global tables. 
-    // Results in roughly 6% smaller files on average, but compression is around 40% slower.
-    FPNG_ENCODE_SLOWER = 1,
-    // Only use raw Deflate blocks (no compression at all). Intended for testing.
-    FPNG_FORCE_UNCOMPRESSED = 2,
+enum IMAGE_FORMAT {
+    IF_RGBA, // 4 bytes per pixel (R, G, B, A)
+    IF_MONO, // 1 bit per pixel, packed MSB first into byte aligned rows (1 = black, 0 = white)
+    IF_RLE, // Monochrome rows kept as sorted lists of the x where the color flips, starting from white. Memory and
+            // fill cost follow the number of edges on the label instead of its area
 };
 
 class Image {
 public:
     int width;
     int height;
+    int stride = 0; // Bytes per row
+    // Rows held in data, an image rendered in bands only stores the rows [band_y0, band_y1) and clips everything else
+    int band_y0 = 0;
+    int band_y1 = 0;
+    IMAGE_FORMAT format = IF_RGBA;
     Color background = WHITE;
     std::vector<uint8_t> data;
+    std::vector<std::vector<int>> runs; // IF_RLE rows [band_y0, band_y1), no positions at or past the width
+    std::vector<int> run_scratch; // Merged row being built, swapped with the row it replaces
+    std::vector<int> run_mask; // Runs of the bitmap row being blitted
+    std::vector<uint8_t> expanded; // IF_RLE rows unpacked for the encoders
     std::vector<unsigned char> output;
+    // Union of everything drawn since the last clear as [x0, x1) x [y0, y1), the rest of the image is still the background.
+    // Code that writes to data directly instead of through the drawing functions has to call markDirty
+    int dirty_x0 = 0;
+    int dirty_y0 = 0;
+    int dirty_x1 = 0;
+    int dirty_y1 = 0;
 
-    std::vector<unsigned char>* toPNG(PNG_ENCODER encoder = PE_LODEPNG) {
-        output.clear();
-        if (encoder == PE_LODEPNG) {
-            int error = lodepng::encode(output, data, width, height);
-            if (error) {
-                notifyf("Error encoding PNG: %s\n", lodepng_error_text(error));
-                return nullptr;
-            }
-            return &output;
-        }
-        if (encoder == PE_FPNG) {
-            // Initialize FPNG
-            fpng::fpng_init();
-            const void* ref = this->data.data();
-            int channels = 4; // RGBA
-            bool success = fpng::fpng_encode_image_to_memory(ref, width, height, channels, output, FPNG_ENCODE_SLOWER);
-            if (!success) {
-                notifyf("Error encoding PNG\n");
-                return nullptr;
-            }
-            return &output;
+    // Encode into out through png, which keeps its buffers between labels. Returns 0 on success
+    int toPNG(PNG_ENCODER encoder, std::vector<unsigned char>& out, PngEncoder& png) {
+        if (format == IF_RLE) return runsToPNG(encoder, out, png);
+        return png.encode(data.data(), stride, width, height, format == IF_MONO, encoder, out);
+    }
+
+    std::vector<unsigned char>* toPNG(PngEncoder& png, PNG_ENCODER encoder = PE_LODEPNG) {
+        if (toPNG(encoder, output, png)) return nullptr;
+        return &output;
+    }
+
+    // Write as a PBM, PGM, BMP or Group 4 TIFF file into out. Returns 0 on success
+    int toRaster(OUTPUT_FORMAT file_format, std::vector<unsigned char>& out, int dpi = 0) {
+        if (format == IF_RLE) {
+            // Group 4 codes the runs as they are, the other formats take packed rows
+            if (file_format == OF_TIFF) return encodeTiffG4Runs(runs, width, height, dpi, out);
+            unpackRows();
+            return encodeRaster(expanded.data(), stride, width, height, true, file_format, out, dpi);
         }
-        notifyf("Unknown PNG encoder %d\n", encoder);
-        return nullptr;
+        return encodeRaster(data.data(), stride, width, height, format == IF_MONO, file_format, out, dpi);
     }
 
     Image() {
         width = 1;
         height = 1;
+        band_y1 = 1;
+        stride = 4;
         data.resize(4);
         clear(WHITE);
     }
 
-    Image(int width, int height, Color color) {
+    Image(int width, int height, Color color, IMAGE_FORMAT format = IF_RGBA) {
         this->width = width;
         this->height = height;
+        this->format = format;
         this->background = color;
-        data.resize(width * height * 4);
+        band_y1 = height;
+        allocate();
         clear(color);
     }
 
+    // Bytes per row, run length rows are unpacked to this size for the encoders
+    static int rowBytes(int width, IMAGE_FORMAT format) {
+        return format == IF_RGBA ? width * 4 : (width + 7) / 8;
+    }
+
+    // Monochrome images store every color with a hue below the midpoint as black
+    static bool isInk(Color color) {
+        return color.getHue() < 128;
+    }
+
     void clear(Color color) {
-        for (int i = 0; i < width * height; i++) {
-            int ix = i * 4;
+        background = color;
+        resetDirty();
+        if (format == IF_RLE) {
+            // Black is one run over the whole row
+            for (std::vector<int>& row : runs) row.assign(isInk(color) ? 1 : 0, 0);
+            return;
+        }
+        if (format == IF_MONO) {
+            memset(data.data(), isInk(color) ? 0xFF : 0x00, data.size());
+            return;
+        }
+        for (size_t i = 0; i < data.size() / 4; i++) {
+            size_t ix = i * 4;
             data[ix + 0] = color.r;
             data[ix + 1] = color.g;
             data[ix + 2] = color.b;
@@ -93,49 +125,428 @@ public:
     }
 
     void resize(int width, int height, Color color) {
+        setBand(width, height, 0, height, color);
+    }
+
+    // Hold only the rows [y0, y1) of a width x height image, so bands of one label can be drawn on separate threads
+    void setBand(int width, int height, int y0, int y1, Color color) {
         if (width <= 0 || height <= 0) return;
-        if (width != this->width || height != this->height) {
-            this->width = width;
-            this->height = height;
-            data.resize(width * height * 4);
+        y0 = std::max(y0, 0);
+        y1 = std::min(y1, height);
+        if (y0 >= y1) return;
+        if (width == this->width && height == this->height && y0 == band_y0 && y1 == band_y1 && sameBackground(color)) {
+            // Everything outside of the dirty region still holds the background, so only that region is restored
+            int x0 = dirty_x0, dy0 = dirty_y0, x1 = dirty_x1, dy1 = dirty_y1;
+            for (int iy = dy0; iy < dy1; iy++) fillSpanRaw(iy, x0, x1, color, false, 0);
+            background = color;
+            resetDirty();
+            return;
         }
-        this->background = color;
+        this->width = width;
+        this->height = height;
+        band_y0 = y0;
+        band_y1 = y1;
+        allocate();
         clear(color);
     }
 
-    void drawPixel(int x, int y, Color color, bool inverted = false) {
-        if (x < 0 || y < 0 || x >= width || y >= height) return;
+    // Size the storage for the rows [band_y0, band_y1), run length images hold no pixel data
+    void allocate() {
+        stride = rowBytes(width, format);
+        int rows = band_y1 - band_y0;
+        if (format == IF_RLE) {
+            data.clear();
+            runs.resize(rows);
+        } else {
+            data.resize((size_t) stride * rows);
+            runs.clear();
+        }
+    }
+
+    // Copy the rows [y0, y1) of an image with the same size and format
+    void copyRows(Image& from, int y0, int y1) {
+        if (y0 >= y1) return;
+        if (format == IF_RLE) {
+            for (int y = y0; y < y1; y++) runs[y - band_y0] = from.runs[y - from.band_y0];
+            return;
+        }
+        memcpy(row(y0), from.row(y0), (size_t) (y1 - y0) * stride);
+    }
+
+    uint8_t* row(int y) {
+        return &data[(size_t) (y - band_y0) * stride];
+    }
+
+    bool isDirty() {
+        return dirty_x0 < dirty_x1 && dirty_y0 < dirty_y1;
+    }
+
+    void resetDirty() {
+        dirty_x0 = dirty_y0 = dirty_x1 = dirty_y1 = 0;
+    }
+
+    // Grow the dirty region to include [x0, x1) x [y0, y1)
+    void markDirty(int x0, int y0, int x1, int y1) {
+        if (x0 >= x1 || y0 >= y1) return;
+        if (!isDirty()) {
+            dirty_x0 = x0;
+            dirty_y0 = y0;
+            dirty_x1 = x1;
+            dirty_y1 = y1;
+            return;
+        }
+        if (x0 < dirty_x0) dirty_x0 = x0;
+        if (y0 < dirty_y0) dirty_y0 = y0;
+        if (x1 > dirty_x1) dirty_x1 = x1;
+        if (y1 > dirty_y1) dirty_y1 = y1;
+    }
+
+    // Whether clearing to the color would leave the untouched pixels unchanged
+    bool sameBackground(Color color) {
+        if (format != IF_RGBA) return isInk(color) == isInk(background);
+        return color.r == background.r && color.g == background.g && color.b == background.b && color.a == background.a;
+    }
+
+    void setFormat(IMAGE_FORMAT format) {
+        if (format == this->format) return;
+        this->format = format;
+        allocate();
+        clear(background);
+    }
+
+    // Write a pixel that is known to be inside the image, the inversion is only used when inverted
+    void plot(int x, int y, Color color, bool inverted, int inversion) {
+        if (format == IF_RLE) {
+            fillSpanRaw(y, x, x + 1, color, inverted, inversion);
+            return;
+        }
+        markDirty(x, y, x + 1, y + 1);
+        if (format == IF_MONO) {
+            uint8_t& byte = row(y)[x >> 3];
+            uint8_t mask = 0x80 >> (x & 7);
+            if (inverted) {
+                if (inversion >= 128) byte ^= mask;
+            } else if (isInk(color)) {
+                byte |= mask;
+            } else {
+                byte &= ~mask;
+            }
+            return;
+        }
         if (inverted) {
-            int hue = color.getHue();
-            int inversion = 255 - hue;
             invertPixel(x, y, inversion);
         } else {
-            size_t idx = 4 * (y * width + x);
-            data[idx] = color.r;
-            data[idx + 1] = color.g;
-            data[idx + 2] = color.b;
-            data[idx + 3] = color.a;
+            uint8_t* px = row(y) + 4 * x;
+            px[0] = color.r;
+            px[1] = color.g;
+            px[2] = color.b;
+            px[3] = color.a;
         }
     }
 
+    void drawPixel(int x, int y, Color color, bool inverted = false) {
+        if (x < 0 || y < band_y0 || x >= width || y >= band_y1) return;
+        int inversion = inverted ? 255 - color.getHue() : 0;
+        plot(x, y, color, inverted, inversion);
+    }
+
     void invertPixel(int x, int y, uint8_t inversion) {
-        if (x < 0 || y < 0 || x >= width || y >= height) return;
-        size_t idx = 4 * (y * width + x);
-        data[idx] = invert_color(data[idx], inversion);
-        data[idx + 1] = invert_color(data[idx + 1], inversion);
-        data[idx + 2] = invert_color(data[idx + 2], inversion);
+        if (x < 0 || y < band_y0 || x >= width || y >= band_y1) return;
+        markDirty(x, y, x + 1, y + 1);
+        if (format == IF_RLE) {
+            if (inversion >= 128) fillRuns(y, x, x + 1, 2);
+            return;
+        }
+        if (format == IF_MONO) {
+            if (inversion >= 128) row(y)[x >> 3] ^= 0x80 >> (x & 7);
+            return;
+        }
+        uint8_t* px = row(y) + 4 * x;
+        px[0] = invert_color(px[0], inversion);
+        px[1] = invert_color(px[1], inversion);
+        px[2] = invert_color(px[2], inversion);
     }
 
     Color getPixel(int x, int y) {
-        if (x < 0 || y < 0 || x >= width || y >= height) return BLANK;
-        size_t idx = 4 * (y * width + x);
-        return Color{ data[idx], data[idx + 1], data[idx + 2], data[idx + 3] };
+        if (x < 0 || y < band_y0 || x >= width || y >= band_y1) return BLANK;
+        if (format == IF_RLE) return runInk(x, y) ? BLACK : WHITE;
+        if (format == IF_MONO) return (row(y)[x >> 3] & (0x80 >> (x & 7))) ? BLACK : WHITE;
+        uint8_t* px = row(y) + 4 * x;
+        return Color{ px[0], px[1], px[2], px[3] };
     }
 
     uint8_t getHue(int x, int y) {
-        if (x < 0 || y < 0 || x >= width || y >= height) return 127;
-        size_t idx = 4 * (y * width + x);
-        return (data[idx] + data[idx + 1] + data[idx + 2]) / 3;
+        if (x < 0 || y < band_y0 || x >= width || y >= band_y1) return 127;
+        if (format == IF_RLE) return runInk(x, y) ? 0 : 255;
+        if (format == IF_MONO) return (row(y)[x >> 3] & (0x80 >> (x & 7))) ? 0 : 255;
+        uint8_t* px = row(y) + 4 * x;
+        return (px[0] + px[1] + px[2]) / 3;
+    }
+
+    // Fill the pixels [x0, x1) of row y, the span must already be clipped to the image
+    void fillSpanRaw(int y, int x0, int x1, Color color, bool inverted, int inversion) {
+        if (x0 >= x1) return;
+        markDirty(x0, y, x1, y + 1);
+        if (format != IF_RGBA) {
+            // 0 = clear, 1 = set, 2 = toggle
+            int mode = inverted ? (inversion >= 128 ? 2 : -1) : (isInk(color) ? 1 : 0);
+            if (mode < 0) return;
+            if (format == IF_RLE) fillRuns(y, x0, x1, mode);
+            else fillBits(row(y), x0, x1, mode);
+            return;
+        }
+        uint8_t* px = row(y) + 4 * x0;
+        if (inverted) {
+            for (int x = x0; x < x1; x++, px += 4) {
+                px[0] = invert_color(px[0], inversion);
+                px[1] = invert_color(px[1], inversion);
+                px[2] = invert_color(px[2], inversion);
+            }
+            return;
+        }
+        uint32_t value;
+        memcpy(&value, &color, 4);
+        for (int x = x0; x < x1; x++, px += 4) memcpy(px, &value, 4);
+    }
+
+    // Clear (mode 0), set (1) or toggle (2) the bits [x0, x1) of a packed row
+    static void fillBits(uint8_t* row, int x0, int x1, int mode) {
+        int b0 = x0 >> 3;
+        int b1 = (x1 - 1) >> 3;
+        uint8_t m0 = 0xFF >> (x0 & 7);
+        uint8_t m1 = 0xFF << (7 - ((x1 - 1) & 7));
+        if (b0 == b1) m0 &= m1;
+        if (mode == 2) row[b0] ^= m0;
+        else if (mode == 1) row[b0] |= m0;
+        else row[b0] &= ~m0;
+        if (b0 == b1) return;
+        if (mode == 2) {
+            for (int i = b0 + 1; i < b1; i++) row[i] ^= 0xFF;
+            row[b1] ^= m1;
+        } else if (mode == 1) {
+            memset(row + b0 + 1, 0xFF, b1 - b0 - 1);
+            row[b1] |= m1;
+        } else {
+            memset(row + b0 + 1, 0x00, b1 - b0 - 1);
+            row[b1] &= ~m1;
+        }
+    }
+
+    // Whether the dot at x of a run length row is black: an odd number of changes at or before it
+    bool runInk(int x, int y) {
+        const std::vector<int>& row = runs[y - band_y0];
+        return (std::upper_bound(row.begin(), row.end(), x) - row.begin()) & 1;
+    }
+
+    // Combine the changes of a run length row with those of a mask, where the mask is black the row is cleared (mode 0),
+    // set (1) or toggled (2). Both lists are walked once, so the cost is their length and not the width of the span
+    static void mergeRuns(const std::vector<int>& row, const int* mask, size_t mask_count, int mode, std::vector<int>& out) {
+        out.clear();
+        size_t i = 0;
+        size_t j = 0;
+        int a = 0; // Color of the row and the mask at x
+        int b = 0;
+        int color = 0;
+        while (i < row.size() || j < mask_count) {
+            int x = j >= mask_count || (i < row.size() && row[i] <= mask[j]) ? row[i] : mask[j];
+            if (i < row.size() && row[i] == x) a ^= 1, i++;
+            if (j < mask_count && mask[j] == x) b ^= 1, j++;
+            int next = mode == 2 ? a ^ b : mode == 1 ? a | b : a & !b;
+            if (next != color) {
+                out.push_back(x);
+                color = next;
+            }
+        }
+    }
+
+    // Clear, set or toggle the dots [x0, x1) of a run length row, the span must already be clipped to the image.
+    // Only the changes inside the span are replaced, found by binary search
+    void fillRuns(int y, int x0, int x1, int mode) {
+        std::vector<int>& row = runs[y - band_y0];
+        if (mode == 2) {
+            // Toggling flips the changes at both ends
+            if (x1 < width) toggleChange(row, x1);
+            toggleChange(row, x0);
+            return;
+        }
+        auto lo = std::lower_bound(row.begin(), row.end(), x0);
+        auto hi = std::upper_bound(lo, row.end(), x1);
+        int before = (lo - row.begin()) & 1; // Color left of the span
+        int after = (hi - row.begin()) & 1; // Color right of it
+        int ends[2];
+        int count = 0;
+        if (before != mode) ends[count++] = x0;
+        if (after != mode && x1 < width) ends[count++] = x1;
+        size_t at = lo - row.begin();
+        size_t removed = hi - lo;
+        if (removed >= (size_t) count) {
+            std::copy(ends, ends + count, lo);
+            row.erase(lo + count, hi);
+        } else {
+            std::copy(ends, ends + removed, lo);
+            row.insert(row.begin() + at + removed, ends + removed, ends + count);
+        }
+    }
+
+    static void toggleChange(std::vector<int>& row, int x) {
+        auto it = std::lower_bound(row.begin(), row.end(), x);
+        if (it != row.end() && *it == x) row.erase(it);
+        else row.insert(it, x);
+    }
+
+    // Packed 1 bpp copy of a run length row, stride bytes
+    void unpackRow(int y, uint8_t* dst) {
+        memset(dst, 0, stride);
+        const std::vector<int>& row = runs[y - band_y0];
+        for (size_t i = 0; i < row.size(); i += 2) fillBits(dst, row[i], i + 1 < row.size() ? row[i + 1] : width, 1);
+    }
+
+    void unpackRows() {
+        expanded.resize((size_t) stride * (band_y1 - band_y0));
+        for (int y = band_y0; y < band_y1; y++) unpackRow(y, expanded.data() + (size_t) (y - band_y0) * stride);
+    }
+
+    // The fast encoder takes a run length image a slice of rows at a time, the others need all of it unpacked
+    int runsToPNG(PNG_ENCODER encoder, std::vector<unsigned char>& out, PngEncoder& png) {
+        if (encoder != PE_FPNG) {
+            unpackRows();
+            return png.encode(expanded.data(), stride, width, height, true, encoder, out);
+        }
+        const int slice = 64;
+        expanded.resize((size_t) stride * slice);
+        out.clear();
+        PngSink sink = [&](const unsigned char* data, size_t size) { out.insert(out.end(), data, data + size); };
+        if (png.beginStream(width, height, sink)) return 1;
+        for (int y = 0; y < height; y += slice) {
+            int count = std::min(slice, height - y);
+            for (int i = 0; i < count; i++) unpackRow(y + i, expanded.data() + (size_t) i * stride);
+            if (png.streamRows(expanded.data(), stride, count)) return 1;
+        }
+        return png.endStream();
+    }
+
+    // Fill the pixels [x0, x1) of row y clipped to the image
+    void fillSpan(int y, int x0, int x1, Color color, bool inverted = false) {
+        if (y < band_y0 || y >= band_y1) return;
+        if (x0 < 0) x0 = 0;
+        if (x1 > width) x1 = width;
+        int inversion = inverted ? 255 - color.getHue() : 0;
+        fillSpanRaw(y, x0, x1, color, inverted, inversion);
+    }
+
+    // Fill a rectangle, clipping is resolved once for the whole block
+    void fillRect(int x, int y, int w, int h, Color color, bool inverted = false) {
+        int x0 = std::max(x, 0);
+        int y0 = std::max(y, band_y0);
+        int x1 = std::min(x + w, width);
+        int y1 = std::min(y + h, band_y1);
+        if (x0 >= x1 || y0 >= y1) return;
+        int inversion = inverted ? 255 - color.getHue() : 0;
+        for (int iy = y0; iy < y1; iy++) fillSpanRaw(iy, x0, x1, color, inverted, inversion);
+    }
+
+    // Bits [p, p + 8) of a packed row of n bytes, bits outside the row read as 0
+    static uint8_t bitsAt(const uint8_t* src, int n, int p) {
+        int k = p >> 3;
+        int s = p & 7;
+        uint8_t hi = k >= 0 && k < n ? src[k] : 0;
+        if (s == 0) return hi;
+        uint8_t lo = k + 1 >= 0 && k + 1 < n ? src[k + 1] : 0;
+        return (uint8_t) (hi << s | lo >> (8 - s));
+    }
+
+    // Draw the set bits of a packed 1 bpp bitmap (MSB first, rows of bitmap_stride bytes) with its top left corner at (x, y).
+    // Mono images take whole bytes at a time, shifted into place when x is not byte aligned
+    void blitBitmap(int x, int y, const uint8_t* bits, int bitmap_stride, int w, int h, Color color, bool inverted = false) {
+        int x0 = std::max(x, 0);
+        int y0 = std::max(y, band_y0);
+        int x1 = std::min(std::min(x + w, x + bitmap_stride * 8), width);
+        int y1 = std::min(y + h, band_y1);
+        if (x0 >= x1 || y0 >= y1) return;
+        int inversion = inverted ? 255 - color.getHue() : 0;
+        if (format == IF_RLE) {
+            // Each row of the bitmap becomes a run list that is merged into the row in one pass
+            int mode = inverted ? (inversion >= 128 ? 2 : -1) : (isInk(color) ? 1 : 0);
+            if (mode < 0) return;
+            markDirty(x0, y0, x1, y1);
+            for (int iy = y0; iy < y1; iy++) {
+                const uint8_t* src = bits + (size_t) (iy - y) * bitmap_stride;
+                run_mask.clear();
+                int ink = 0;
+                for (int ix = x0; ix < x1;) {
+                    int p = ix - x;
+                    if ((p & 7) == 0 && ix + 8 <= x1 && src[p >> 3] == (ink ? 0xFF : 0x00)) {
+                        ix += 8; // A whole byte of the current color
+                        continue;
+                    }
+                    if (((src[p >> 3] >> (7 - (p & 7))) & 1) != ink) {
+                        run_mask.push_back(ix);
+                        ink ^= 1;
+                    }
+                    ix++;
+                }
+                if (ink && x1 < width) run_mask.push_back(x1);
+                if (run_mask.empty()) continue;
+                std::vector<int>& row = runs[iy - band_y0];
+                mergeRuns(row, run_mask.data(), run_mask.size(), mode, run_scratch);
+                row.swap(run_scratch);
+            }
+            return;
+        }
+        if (format != IF_MONO) {
+            for (int iy = y0; iy < y1; iy++) {
+                const uint8_t* src = bits + (size_t) (iy - y) * bitmap_stride;
+                for (int ix = x0; ix < x1; ix++) {
+                    int p = ix - x;
+                    if (src[p >> 3] & (0x80 >> (p & 7))) plot(ix, iy, color, inverted, inversion);
+                }
+            }
+            return;
+        }
+        // 0 = clear, 1 = set, 2 = toggle
+        int mode = inverted ? (inversion >= 128 ? 2 : -1) : (isInk(color) ? 1 : 0);
+        if (mode < 0) return;
+        markDirty(x0, y0, x1, y1);
+        int b0 = x0 >> 3;
+        int b1 = (x1 - 1) >> 3;
+        uint8_t m0 = 0xFF >> (x0 & 7);
+        uint8_t m1 = 0xFF << (7 - ((x1 - 1) & 7));
+        if (b0 == b1) m0 &= m1;
+        for (int iy = y0; iy < y1; iy++) {
+            const uint8_t* src = bits + (size_t) (iy - y) * bitmap_stride;
+            uint8_t* dst = row(iy);
+            for (int b = b0; b <= b1; b++) {
+                uint8_t v = bitsAt(src, bitmap_stride, 8 * b - x);
+                if (b == b0) v &= m0;
+                if (b == b1) v &= m1;
+                if (mode == 2) dst[b] ^= v;
+                else if (mode == 1) dst[b] |= v;
+                else dst[b] &= ~v;
+            }
+        }
+    }
+
+    // Largest e >= 0 with e^2 * a <= b (or -1 when b < 0), walked from the extent of the previous row.
+    // Consecutive rows of a circle or ellipse only move the extent by a few pixels, so the walk is amortized O(1) per row
+    static int stepExtent(int e, int64_t a, int64_t b) {
+        if (b < 0) return -1;
+        if (e < 0) e = 0;
+        while (e > 0 && (int64_t) e * e * a > b) e--;
+        while ((int64_t) (e + 1) * (e + 1) * a <= b) e++;
+        return e;
+    }
+
+    // Restricts the column range [lo, hi] to the dx where a * dx + b >= 0 (or > 0 when strict)
+    static void clipHalfPlane(double a, double b, bool strict, int& lo, int& hi) {
+        const double eps = 1e-9;
+        if (a > eps || a < -eps) {
+            double v = -b / a;
+            v = std::max(std::min(v, (double) hi + 1), (double) lo - 1);
+            if (a > 0) lo = std::max(lo, strict ? (int) floor(v + eps) + 1 : (int) ceil(v - eps));
+            else hi = std::min(hi, strict ? (int) ceil(v - eps) - 1 : (int) floor(v + eps));
+        } else if (strict ? b <= eps : b < -eps) {
+            hi = lo - 1;
+        }
     }
 
     void drawText(int x, int y, int font_size, const char* text, const char* font, Color color, bool inverted = false) {
@@ -154,21 +565,20 @@ public:
 
         for (int i = 0; i < length; i++) {
             char c = text[i];
-            FT_GlyphSlot* glyph = FontLib.getChar(c, font, font_size);
+            const FontLib_t::Glyph* glyph = FontLib.getGlyph(c, font, font_size);
             if (glyph) {
-                FT_GlyphSlot& g = glyph[0];
-                FT_Bitmap& bitmap = g->bitmap;
-                int iw = bitmap.width;
-                int ih = bitmap.rows;
-                int offsetX = x_pos + g->bitmap_left;
-                int offsetY = offset - g->bitmap_top;
+                const FontLib_t::Glyph& g = glyph[0];
+                int iw = g.width;
+                int ih = g.rows;
+                int offsetX = x_pos + g.left;
+                int offsetY = offset - g.top;
                 for (int iy = 0; iy < ih; iy++) {
                     int y_px = y + iy + offsetY;
-                    if (y_px < 0 || y_px >= height) continue;
+                    if (y_px < band_y0 || y_px >= band_y1) continue;
                     for (int ix = 0; ix < iw; ix++) {
                         int x_px = offsetX + ix;
                         if (x_px < 0 || x_px >= width) continue;
-                        uint8_t greyscale = bitmap.buffer[((int) iy) * iw + ((int) ix)]; // Single 8 bit value
+                        uint8_t greyscale = g.buffer[iy * iw + ix]; // Single 8 bit value
                         // if (greyscale > 0) {
                             // greyscale = inverted ? greyscale : (255 - greyscale);
                             // Color color = { greyscale , greyscale, greyscale,  0xFF };
@@ -179,44 +589,123 @@ public:
                         }
                     }
                 }
-                x_pos += g->advance.x >> 6;
+                x_pos += g.advance;
             } else {
                 notifyf("Glyph '%c' not found\n", c);
             }
         }
     }
 
-    void fillPolygon(std::vector<Vector2> points, Color color, bool inverted = false) {
-        auto isInsidePolygon = [&points](int x, int y) {
-            bool inside = false;
-            for (size_t i = 0, j = points.size() - 1; i < points.size(); j = i++) {
-                if (((points[i].y > y) != (points[j].y > y)) &&
-                    (x < (points[j].x - points[i].x) * (y - points[i].y) / (points[j].y - points[i].y) + points[i].x)) {
-                    inside = !inside;
+    // Bounds [x0, x1) x [y0, y1) of the pixels drawText can set, false when it draws nothing
+    static bool measureText(int x, int y, int font_size, const char* text, const char* font, int& x0, int& y0, int& x1, int& y1) {
+        x0 = y0 = x1 = y1 = 0;
+        if (font_size <= 0) return false;
+        int offset = font_size * 2 / 3;
+        int x_pos = x;
+        int length = strlen(text);
+        bool found = false;
+        for (int i = 0; i < length; i++) {
+            const FontLib_t::Glyph* glyph = FontLib.getGlyph(text[i], font, font_size);
+            if (!glyph) continue;
+            const FontLib_t::Glyph& g = glyph[0];
+            if (g.width > 0 && g.rows > 0) {
+                int gx0 = x_pos + g.left;
+                int gy0 = y + offset - g.top;
+                int gx1 = gx0 + g.width;
+                int gy1 = gy0 + g.rows;
+                if (!found) {
+                    x0 = gx0;
+                    y0 = gy0;
+                    x1 = gx1;
+                    y1 = gy1;
+                    found = true;
+                } else {
+                    x0 = std::min(x0, gx0);
+                    y0 = std::min(y0, gy0);
+                    x1 = std::max(x1, gx1);
+                    y1 = std::max(y1, gy1);
                 }
             }
-            return inside;
-            };
+            x_pos += g.advance;
+        }
+        return found;
+    }
 
-        int hue = inverted ? color.getHue() : 255;
-        int inversion = 255 - hue;
-        for (int y = 0; y < height; ++y) {
-            for (int x = 0; x < width; ++x) {
-                if (isInsidePolygon(x, y)) {
-                    if (inverted) {
-                        invertPixel(x, y, inversion);
-                    } else {
-                        size_t idx = 4 * (y * width + x);
-                        data[idx] = color.r;
-                        data[idx + 1] = color.g;
-                        data[idx + 2] = color.b;
-                        data[idx + 3] = color.a;
-                    }
-                }
+    // Scanline polygon fill with the even-odd rule, a pixel is inside when the point (x, y) is inside the polygon.
+    // Only the rows and spans covered by the polygon are visited.
+    void fillPolygon(const Vector2* points, int count, Color color, bool inverted = false) {
+        if (!points || count < 3) return;
+        struct Edge {
+            int y_start; // First row crossed by the edge
+            int y_end; // Row after the last row crossed by the edge
+            double x0, y0; // Upper end point
+            double dx, dy;
+            double x; // Intersection with the current row
+        };
+        // Edge table sorted by the first row
+        std::vector<Edge> edges;
+        edges.reserve(count);
+        for (int i = 0, j = count - 1; i < count; j = i++) {
+            Vector2 a = points[j];
+            Vector2 b = points[i];
+            if (a.y > b.y) std::swap(a, b);
+            Edge edge;
+            edge.y_start = (int) ceilf(a.y);
+            edge.y_end = (int) ceilf(b.y);
+            if (edge.y_start >= edge.y_end) continue; // Horizontal or between rows
+            edge.x0 = a.x;
+            edge.y0 = a.y;
+            edge.dx = (double) b.x - a.x;
+            edge.dy = (double) b.y - a.y;
+            edges.push_back(edge);
+        }
+        if (edges.empty()) return;
+        std::sort(edges.begin(), edges.end(), [](const Edge& a, const Edge& b) { return a.y_start < b.y_start; });
+        int y_max = 0;
+        for (const Edge& edge : edges) y_max = std::max(y_max, edge.y_end);
+        y_max = std::min(y_max, band_y1);
+
+        int inversion = inverted ? 255 - color.getHue() : 0;
+        std::vector<Edge> active;
+        size_t next = 0;
+        int y = std::max(edges[0].y_start, band_y0);
+        for (; y < y_max; y++) {
+            // Add edges starting at this row (or above the image) and drop finished ones
+            while (next < edges.size() && edges[next].y_start <= y) active.push_back(edges[next++]);
+            for (size_t i = 0; i < active.size();) {
+                if (active[i].y_end <= y) {
+                    active[i] = active.back();
+                    active.pop_back();
+                } else i++;
+            }
+            if (active.empty()) {
+                if (next >= edges.size()) break;
+                y = edges[next].y_start - 1; // Skip the gap to the next edge
+                continue;
+            }
+            // Intersections are computed from the end points on every row so rounding does not accumulate
+            for (Edge& edge : active) edge.x = edge.dx * (y - edge.y0) / edge.dy + edge.x0;
+            // Insertion sort by intersection, the order barely changes between rows
+            for (size_t i = 1; i < active.size(); i++) {
+                Edge edge = active[i];
+                size_t j = i;
+                for (; j > 0 && active[j - 1].x > edge.x; j--) active[j] = active[j - 1];
+                active[j] = edge;
+            }
+            for (size_t i = 0; i + 1 < active.size(); i += 2) {
+                double a = std::max(std::min(active[i].x, (double) width), -1.0);
+                double b = std::max(std::min(active[i + 1].x, (double) width), -1.0);
+                int x0 = std::max((int) ceil(a), 0);
+                int x1 = std::min((int) ceil(b), width);
+                fillSpanRaw(y, x0, x1, color, inverted, inversion);
             }
         }
     }
 
+    void fillPolygon(const std::vector<Vector2>& points, Color color, bool inverted = false) {
+        fillPolygon(points.data(), points.size(), color, inverted);
+    }
+
     void drawLine(int x0, int y0, int x1, int y1, int stroke_width, Color color, bool inverted = false) {
         int dx = abs(x1 - x0);
         int sx = x0 < x1 ? 1 : -1;
@@ -229,16 +718,8 @@ public:
             for (int i = -stroke_width / 2; i < stroke_width / 2; i++) {
                 int ix = x0 + i;
                 int iy = y0 + i;
-                if (ix >= 0 && iy >= 0 && ix < width && iy < height) {
-                    if (inverted) {
-                        invertPixel(ix, iy, inversion);
-                    } else {
-                        size_t idx = 4 * (iy * width + ix);
-                        data[idx] = color.r;
-                        data[idx + 1] = color.g;
-                        data[idx + 2] = color.b;
-                        data[idx + 3] = color.a;
-                    }
+                if (ix >= 0 && iy >= band_y0 && ix < width && iy < band_y1) {
+                    plot(ix, iy, color, inverted, inversion);
                 }
             }
             if (x0 == x1 && y0 == y1) break;
@@ -257,93 +738,41 @@ public:
     void drawDiagonalZPL(int x, int y, int w, int h, char direction, int stroke_width, Color stroke, bool inverted = false) {
         // The diagonal line is either 'L' (left or '\' line) or 'R' (right or '/' line)
         // The stroke is always drawn on the right side of the line
-        int hue = inverted ? stroke.getHue() : 255;
-        int inversion = 255 - hue;
+        if (direction != 'L' && direction != 'R') return;
         double slope = (double) h / w;
-        if (direction == 'L') { // Left diagonal line ('\') drawn from top row to bottom row
-            for (int iy = y; iy < y + h; iy++) {
-                // get the x position of the diagonal for the current row
-                int ix = x + (int) ((double)(iy - y) / slope);
-                for (int i = 0; i < stroke_width; i++, ix++) {
-                    if (ix < 0 || iy < 0 || ix >= width || iy >= height) continue; // Skip out of image bounds
-                    if (inverted) {
-                        invertPixel(ix, iy, inversion);
-                    } else {
-                        size_t idx = 4 * (iy * width + ix);
-                        data[idx] = stroke.r;
-                        data[idx + 1] = stroke.g;
-                        data[idx + 2] = stroke.b;
-                        data[idx + 3] = stroke.a;
-                    }
-                }
-            }
-        } else if (direction == 'R') { // Right diagonal line ('/') drawn from top row to bottom row
-            for (int iy = y; iy < y + h; iy++) {
-                // get the x position of the diagonal for the current row
-                int ix = x + w - (int) ((double)(iy - y) / slope);
-                for (int i = 0; i < stroke_width; i++, ix++) {
-                    if (ix < 0 || iy < 0 || ix >= width || iy >= height) continue; // Skip out of image bounds
-                    if (inverted) {
-                        invertPixel(ix, iy, inversion);
-                    } else {
-                        size_t idx = 4 * (iy * width + ix);
-                        data[idx] = stroke.r;
-                        data[idx + 1] = stroke.g;
-                        data[idx + 2] = stroke.b;
-                        data[idx + 3] = stroke.a;
-                    }
-                }
-            }
+        int y0 = std::max(y, band_y0);
+        int y1 = std::min(y + h, band_y1);
+        for (int iy = y0; iy < y1; iy++) {
+            // get the x position of the diagonal for the current row
+            int ix;
+            if (direction == 'L') ix = x + (int) ((double) (iy - y) / slope); // Left diagonal line ('\') drawn from top row to bottom row
+            else ix = x + w - (int) ((double) (iy - y) / slope); // Right diagonal line ('/') drawn from top row to bottom row
+            fillSpan(iy, ix, ix + stroke_width, stroke, inverted);
         }
     }
 
     void drawRect(int x, int y, int w, int h, int stroke_width, Color stroke, Color fill, bool inverted = false) {
-        int fill_hue = inverted ? fill.getHue() : 255;
-        int fill_inversion = 255 - fill_hue;
-        int stroke_hue = inverted ? stroke.getHue() : 255;
-        int stroke_inversion = 255 - stroke_hue;
         int x1 = x;
         int x2 = x + w;
         int y1 = y;
         int y2 = y + h;
         if (!fill.isBlank()) {
-            for (int iy = y1; iy < y2; iy++) {
-                for (int ix = x1; ix < x2; ix++) {
-                    if (ix < 0 || iy < 0 || ix >= width || iy >= height) continue; // Skip out of image bounds
-                    if (inverted) {
-                        invertPixel(ix, iy, fill_inversion);
-                    } else {
-                        size_t idx = 4 * (iy * width + ix);
-                        data[idx] = fill.r;
-                        data[idx + 1] = fill.g;
-                        data[idx + 2] = fill.b;
-                        data[idx + 3] = fill.a;
-                    }
-                }
-            }
+            fillRect(x, y, w, h, fill, inverted);
         }
         if (!stroke.isBlank()) {
             int pad_left = x1 + stroke_width;
             int pad_right = x2 - stroke_width;
             int pad_top = y1 + stroke_width;
             int pad_bottom = y2 - stroke_width;
-            for (int iy = y1; iy < y2; iy++) {
-                for (int ix = x1; ix < x2; ix++) {
-                    if (ix < 0 || iy < 0 || ix >= width || iy >= height) continue; // Skip out of image bounds
-
-                    if (ix >= pad_left && ix < pad_right && iy >= pad_top && iy < pad_bottom) continue; // Skip inside of the stroke
-
-                    if (inverted) {
-                        invertPixel(ix, iy, stroke_inversion);
-                    } else {
-                        size_t idx = 4 * (iy * width + ix);
-                        data[idx] = stroke.r;
-                        data[idx + 1] = stroke.g;
-                        data[idx + 2] = stroke.b;
-                        data[idx + 3] = stroke.a;
-                    }
-                }
+            if (pad_left >= pad_right || pad_top >= pad_bottom) {
+                // The stroke covers the whole rectangle
+                fillRect(x, y, w, h, stroke, inverted);
+                return;
             }
+            fillRect(x1, y1, w, pad_top - y1, stroke, inverted); // Top
+            fillRect(x1, pad_bottom, w, y2 - pad_bottom, stroke, inverted); // Bottom
+            fillRect(x1, pad_top, pad_left - x1, pad_bottom - pad_top, stroke, inverted); // Left
+            fillRect(pad_right, pad_top, x2 - pad_right, pad_bottom - pad_top, stroke, inverted); // Right
         }
     }
 
@@ -352,31 +781,8 @@ public:
     }
 
     void fillTriangle(Vector2 p1, Vector2 p2, Vector2 p3, Color color, bool inverted = false) {
-        // Sort the vertices by y-coordinate ascending to simplify
-        if (p1.y > p2.y) std::swap(p1, p2);
-        if (p1.y > p3.y) std::swap(p1, p3);
-        if (p2.y > p3.y) std::swap(p2, p3);
-        int hue = inverted ? color.getHue() : 255;
-        int inversion = 255 - hue;
-        // Manually compute the scanline
-        for (int y = p1.y; y <= p3.y; y++) {
-            float t = (y - p1.y) / (p3.y - p1.y);
-            float xl = lerp(p1.x, p3.x, t);
-            float xr = lerp(p1.x, p2.x, (y - p1.y) / (p2.y - p1.y));
-            if (xl > xr) std::swap(xl, xr);
-            for (int x = xl; x <= xr; x++) {
-                if (x < 0 || y < 0 || x >= width || y >= height) continue;
-                if (inverted) {
-                    invertPixel(x, y, inversion);
-                } else {
-                    size_t idx = 4 * (y * width + x);
-                    data[idx] = color.r;
-                    data[idx + 1] = color.g;
-                    data[idx + 2] = color.b;
-                    data[idx + 3] = color.a;
-                }
-            }
-        }
+        const Vector2 points[3] = { p1, p2, p3 };
+        fillPolygon(points, 3, color, inverted);
     }
 
     void drawTriangle(Vector2 p1, Vector2 p2, Vector2 p3, int stroke_width, Color stroke, Color fill, bool inverted = false) {
@@ -392,8 +798,8 @@ public:
 
     void drawQuad(Vector2 p1, Vector2 p2, Vector2 p3, Vector2 p4, int stroke_width, Color stroke, Color fill, bool inverted = false) {
         if (!fill.isBlank()) {
-            fillTriangle(p1, p2, p3, fill, inverted);
-            fillTriangle(p1, p3, p4, fill, inverted);
+            const Vector2 points[4] = { p1, p2, p3, p4 };
+            fillPolygon(points, 4, fill, inverted);
         }
         if (!stroke.isBlank()) {
             drawLine(p1.x, p1.y, p2.x, p2.y, stroke_width, stroke, inverted);
@@ -404,134 +810,158 @@ public:
     }
 
     void drawCircle(int x, int y, int radius, int stroke_width, Color stroke, Color fill, bool inverted = false) {
-        int fill_hue = inverted ? fill.getHue() : 255;
-        int fill_inversion = 255 - fill_hue;
-        int stroke_hue = inverted ? stroke.getHue() : 255;
-        int stroke_inversion = 255 - stroke_hue;
+        // A pixel at (dx, dy) from the center is inside when dx^2 + dy^2 - 1 <= radius^2
         int r2_outer = radius * radius;
         int r2_inner = (radius - stroke_width) * (radius - stroke_width);
-        if (!fill.isBlank()) {
-            for (int iy = y - radius; iy < y + radius; iy++) {
-                for (int ix = x - radius; ix < x + radius; ix++) {
-                    if (ix < 0 || iy < 0 || ix >= width || iy >= height) continue;
-                    int r2 = (ix - x) * (ix - x) + (iy - y) * (iy - y) - 1;
-                    if (r2_outer >= r2) {
-                        if (inverted) {
-                            invertPixel(ix, iy, fill_inversion);
-                        } else {
-                            size_t idx = 4 * (iy * width + ix);
-                            data[idx] = fill.r;
-                            data[idx + 1] = fill.g;
-                            data[idx + 2] = fill.b;
-                            data[idx + 3] = fill.a;
-                        }
-                    }
-                }
-            }
-        }
-        if (!stroke.isBlank()) {
-            for (int iy = y - radius; iy < y + radius; iy++) {
-                for (int ix = x - radius; ix < x + radius; ix++) {
-                    if (ix < 0 || iy < 0 || ix >= width || iy >= height) continue;
-                    int r2 = (ix - x) * (ix - x) + (iy - y) * (iy - y) - 1;
-                    if (r2_outer >= r2 && r2 >= r2_inner) {
-                        if (inverted) {
-                            invertPixel(ix, iy, stroke_inversion);
-                        } else {
-                            size_t idx = 4 * (iy * width + ix);
-                            data[idx] = stroke.r;
-                            data[idx + 1] = stroke.g;
-                            data[idx + 2] = stroke.b;
-                            data[idx + 3] = stroke.a;
-                        }
-                    }
+        bool doFill = !fill.isBlank();
+        bool doStroke = !stroke.isBlank();
+        if (!doFill && !doStroke) return;
+        int y0 = std::max(y - radius, band_y0);
+        int y1 = std::min(y + radius, band_y1);
+        int dx_max = 0;
+        int dx_inner = 0;
+        for (int iy = y0; iy < y1; iy++) {
+            int dy2 = (iy - y) * (iy - y);
+            int m = r2_outer + 1 - dy2;
+            if (m < 0) continue;
+            dx_max = stepExtent(dx_max, 1, m);
+            int left = std::max(x - dx_max, x - radius);
+            int right = std::min(x + dx_max + 1, x + radius);
+            if (doFill) fillSpan(iy, left, right, fill, inverted);
+            if (doStroke) {
+                int n = r2_inner + 1 - dy2;
+                if (n > 0) dx_inner = stepExtent(dx_inner, 1, n - 1);
+                int dx_min = n > 0 ? dx_inner + 1 : 0; // Smallest |dx| on the ring
+                if (dx_min == 0) {
+                    fillSpan(iy, left, right, stroke, inverted);
+                } else {
+                    fillSpan(iy, left, std::min(x - dx_min + 1, right), stroke, inverted);
+                    fillSpan(iy, std::max(x + dx_min, left), right, stroke, inverted);
                 }
             }
         }
     }
 
     void drawEllipse(int x, int y, int w, int h, int stroke_width, Color stroke, Color fill, bool inverted = false) {
-        int fill_hue = inverted ? fill.getHue() : 255;
-        int fill_inversion = 255 - fill_hue;
-        int stroke_hue = inverted ? stroke.getHue() : 255;
-        int stroke_inversion = 255 - stroke_hue;
+        // A pixel at (dx, dy) from the center is inside when dx^2 / rw^2 + dy^2 / rh^2 <= 1
         int rw = w / 2;
         int rh = h / 2;
+        if (rw <= 0 || rh <= 0) return;
         int inner_rw = rw - stroke_width > 0 ? rw - stroke_width : 0;
         int inner_rh = rh - stroke_width > 0 ? rh - stroke_width : 0;
-        int rw2 = rw * rw;
-        int rh2 = rh * rh;
-        int inner_rw2 = inner_rw * inner_rw;
-        int inner_rh2 = inner_rh * inner_rh;
-        bool fully_filled = stroke_width >= std::min(w, h);
-        for (int iy = y - rh; iy < y + rh; iy++) {
-            for (int ix = x - rw; ix < x + rw; ix++) {
-                if (ix < 0 || iy < 0 || ix >= width || iy >= height) continue;
-                float outer_eq = ((ix - x) * (ix - x)) / (float) rw2 + ((iy - y) * (iy - y)) / (float) rh2;
-                float inner_eq = ((ix - x) * (ix - x)) / (float) inner_rw2 + ((iy - y) * (iy - y)) / (float) inner_rh2;
-                if (outer_eq <= 1) {
-                    if (inner_eq > 1 || fully_filled) {
-                        if (inverted) {
-                            invertPixel(ix, iy, fill_inversion);
-                        } else {
-                            size_t idx = 4 * (iy * width + ix);
-                            data[idx] = fill.r;
-                            data[idx + 1] = fill.g;
-                            data[idx + 2] = fill.b;
-                            data[idx + 3] = fill.a;
-                        }
-                    }
-                }
+        int64_t rw2 = rw * rw;
+        int64_t rh2 = rh * rh;
+        int64_t inner_rw2 = inner_rw * inner_rw;
+        int64_t inner_rh2 = inner_rh * inner_rh;
+        bool fully_filled = stroke_width >= std::min(w, h) || inner_rw == 0 || inner_rh == 0;
+        int y0 = std::max(y - rh, band_y0);
+        int y1 = std::min(y + rh, band_y1);
+        int dx_max = 0;
+        int dx_inner = 0;
+        for (int iy = y0; iy < y1; iy++) {
+            int64_t dy2 = (iy - y) * (iy - y);
+            int64_t t = rw2 * rh2 - dy2 * rw2;
+            if (t < 0) continue;
+            dx_max = stepExtent(dx_max, rh2, t);
+            int left = std::max(x - dx_max, x - rw);
+            int right = std::min(x + dx_max + 1, x + rw);
+            int64_t t_inner = inner_rw2 * inner_rh2 - dy2 * inner_rw2;
+            if (fully_filled || t_inner < 0) {
+                fillSpan(iy, left, right, stroke, inverted);
+                continue;
             }
+            dx_inner = stepExtent(dx_inner, inner_rh2, t_inner);
+            int dx_min = dx_inner + 1; // Smallest |dx| outside of the inner ellipse
+            fillSpan(iy, left, std::min(x - dx_min + 1, right), stroke, inverted);
+            fillSpan(iy, std::max(x + dx_min, left), right, stroke, inverted);
         }
     }
 
     void drawArc(Vector2 center, int radius, int startAngle, int endAngle, int stroke_width, Color stroke, Color fill, bool inverted = false) {
-        int fill_hue = inverted ? fill.getHue() : 255;
-        int fill_inversion = 255 - fill_hue;
-        int stroke_hue = inverted ? stroke.getHue() : 255;
-        int stroke_inversion = 255 - stroke_hue;
+        // A pixel at (dx, dy) from the center is on the arc when dx^2 + dy^2 - 1 <= radius^2 and its angle atan2(dy, dx)
+        // lies in [startAngle, endAngle]. The sector is bounded by half-planes through the center, which reduce to a column
+        // range on every row, so the arc is drawn as spans without any per-pixel trigonometry
+        bool doFill = !fill.isBlank();
+        bool doStroke = !stroke.isBlank();
+        if (!doFill && !doStroke) return;
+        if (radius <= 0 || endAngle < startAngle) return;
+        int sweep = endAngle - startAngle;
+        bool full = sweep >= 360;
+        double s_ang = startAngle * DEG2RAD;
+        double e_ang = endAngle * DEG2RAD;
+        double m_ang = (startAngle + sweep / 2.0) * DEG2RAD;
+        double sx = cos(s_ang), sy = sin(s_ang);
+        double ex = cos(e_ang), ey = sin(e_ang);
+        double mx = cos(m_ang), my = sin(m_ang);
+        int cx = floorf(center.x + 0.5f);
+        int cy = floorf(center.y + 0.5f);
         int r2_outer = radius * radius;
         int r2_inner = (radius - stroke_width) * (radius - stroke_width);
-        if (!fill.isBlank()) {
-            for (int iy = center.y - radius; iy < center.y + radius; iy++) {
-                for (int ix = center.x - radius; ix < center.x + radius; ix++) {
-                    if (ix < 0 || iy < 0 || ix >= width || iy >= height) continue;
-                    float angle = atan2f(iy - center.y, ix - center.x) * RAD2DEG;
-                    if (angle < startAngle || angle > endAngle) continue;
-                    int r2 = (ix - center.x) * (ix - center.x) + (iy - center.y) * (iy - center.y) - 1;
-                    if (r2_outer >= r2) {
-                        if (inverted) {
-                            invertPixel(ix, iy, fill_inversion);
-                        } else {
-                            size_t idx = 4 * (iy * width + ix);
-                            data[idx] = fill.r;
-                            data[idx + 1] = fill.g;
-                            data[idx + 2] = fill.b;
-                            data[idx + 3] = fill.a;
-                        }
+        int y0 = std::max(cy - radius, band_y0);
+        int y1 = std::min(cy + radius, band_y1);
+        int dx_max = 0;
+        int dx_inner = 0;
+        for (int iy = y0; iy < y1; iy++) {
+            int dy = iy - cy;
+            int m = r2_outer + 1 - dy * dy;
+            if (m < 0) continue;
+            dx_max = stepExtent(dx_max, 1, m);
+            int left = std::max(-dx_max, -radius);
+            int right = std::min(dx_max, radius - 1);
+            // Columns of the sector on this row, at most two ranges
+            int sector[2][2];
+            int count = 0;
+            if (full) {
+                sector[count][0] = left;
+                sector[count][1] = right;
+                count++;
+            } else if (sweep <= 180) {
+                // Inside of the start and end edges, and on the same side as the bisector to reject the opposite wedge
+                int lo = left, hi = right;
+                clipHalfPlane(-sy, sx * dy, false, lo, hi);
+                clipHalfPlane(ey, -ex * dy, false, lo, hi);
+                clipHalfPlane(mx, my * dy, false, lo, hi);
+                if (lo <= hi) {
+                    sector[count][0] = lo;
+                    sector[count][1] = hi;
+                    count++;
+                }
+            } else {
+                // Everything but the open wedge between the end and the start edge
+                int lo = left, hi = right;
+                clipHalfPlane(sy, -sx * dy, true, lo, hi);
+                clipHalfPlane(-ey, ex * dy, true, lo, hi);
+                if (lo > hi) {
+                    sector[count][0] = left;
+                    sector[count][1] = right;
+                    count++;
+                } else {
+                    if (left < lo) {
+                        sector[count][0] = left;
+                        sector[count][1] = lo - 1;
+                        count++;
+                    }
+                    if (hi < right) {
+                        sector[count][0] = hi + 1;
+                        sector[count][1] = right;
+                        count++;
                     }
                 }
             }
-        }
-        if (!stroke.isBlank()) {
-            for (int iy = center.y - radius; iy < center.y + radius; iy++) {
-                for (int ix = center.x - radius; ix < center.x + radius; ix++) {
-                    if (ix < 0 || iy < 0 || ix >= width || iy >= height) continue;
-                    float angle = atan2f(iy - center.y, ix - center.x) * RAD2DEG;
-                    if (angle < startAngle || angle > endAngle) continue;
-                    int r2 = (ix - center.x) * (ix - center.x) + (iy - center.y) * (iy - center.y) - 1;
-                    if (r2_outer >= r2 && r2 >= r2_inner) {
-                        if (inverted) {
-                            invertPixel(ix, iy, stroke_inversion);
-                        } else {
-                            size_t idx = 4 * (iy * width + ix);
-                            data[idx] = stroke.r;
-                            data[idx + 1] = stroke.g;
-                            data[idx + 2] = stroke.b;
-                            data[idx + 3] = stroke.a;
-                        }
-                    }
+            if (count == 0) continue;
+            int n = r2_inner + 1 - dy * dy;
+            if (doStroke && n > 0) dx_inner = stepExtent(dx_inner, 1, n - 1);
+            int dx_min = n > 0 ? dx_inner + 1 : 0; // Smallest |dx| on the ring
+            for (int i = 0; i < count; i++) {
+                int a = sector[i][0];
+                int b = sector[i][1];
+                if (doFill) fillSpan(iy, cx + a, cx + b + 1, fill, inverted);
+                if (!doStroke) continue;
+                if (dx_min == 0) {
+                    fillSpan(iy, cx + a, cx + b + 1, stroke, inverted);
+                } else {
+                    fillSpan(iy, cx + a, cx + std::min(b, -dx_min) + 1, stroke, inverted);
+                    fillSpan(iy, cx + std::max(a, dx_min), cx + b + 1, stroke, inverted);
                 }
             }
         }
@@ -539,22 +969,12 @@ public:
 
     void drawRoundedRectangle(int x, int y, int w, int h, float roundness, int stroke_width, Color stroke, Color fill, bool inverted = false) {
         if (roundness <= 0) return drawRect(x, y, w, h, stroke_width, stroke, fill, inverted);
-        int fill_hue = inverted ? fill.getHue() : 255;
-        int fill_inversion = 255 - fill_hue;
-        int stroke_hue = inverted ? stroke.getHue() : 255;
-        int stroke_inversion = 255 - stroke_hue;
         if (roundness > 1) roundness = 1;
         int radius = roundness * std::min(w, h) / 2;
         int rx1 = x + radius; // Center of the top-left rounded corner (x)
         int ry1 = y + radius; // Center of the top-left rounded corner (y)
-        int rx2 = x + w - radius; // Center of the top-right rounded corner (x)
-        int ry2 = ry1; // Center of the top-right rounded corner (y)
-        int rx3 = rx2; // Center of the bottom-right rounded corner (x)
-        int ry3 = y + h - radius; // Center of the bottom-right rounded corner (y)
-        int rx4 = rx1; // Center of the bottom-left rounded corner (x)
-        int ry4 = ry3; // Center of the bottom-left rounded corner (y)
-        float r = radius;
-        // Draw the top left quarter of the rounded rectangle and mirror the pixels to the other three quarters
+        int r2 = radius * radius;
+        // Compute the spans of the top left quarter of the rounded rectangle and mirror them to the other three quarters
         int x_odd = w % 2;
         int y_odd = h % 2;
 
@@ -566,132 +986,78 @@ public:
         int yM = y + h / 2 + y_odd; // Middle
         int yB = y + h - 1; // Bottom
 
-        int x_pos = 0;
-        int y_pos = 0;
-
         bool doInfill = !fill.isBlank();
         bool doStroke = !stroke.isBlank();
+        if (!doInfill && !doStroke) return;
+        Color color = doInfill ? fill : stroke;
 
-        if (doInfill) {
-            for (int iy = yT, y_pos = 0; iy < yM; iy++, y_pos++) {
-                bool visible = 0;
-                bool y_last = iy == yM - 1;
-                for (int ix = xL, x_pos = 0; ix < xM; ix++, x_pos++) {
-                    bool x_last = ix == xM - 1;
-                    bool top_left = (ix < rx1 && iy < ry1);
-                    bool in_rect = !top_left;
-
-                    if (top_left) {
-                        // Get the distance from the center of the rounded corner
-                        float dx = ix - rx1;
-                        float dy = iy - ry1;
-                        float dx2 = dx * dx;
-                        float dy2 = dy * dy;
-                        float dr = sqrtf(dx2 + dy2);
-                        float delta = dr - r;
-                        visible = delta <= 0;
-                    }
-                    if (in_rect) visible = true;
-
-                    // Test
-                    // visible = top_left || top_right || bottom_right || bottom_left;
-
-                    if (!visible) continue;
-
-                    int ix_mirror = xR - x_pos;
-                    int iy_mirror = yB - y_pos;
-                    for (int i = 0; i < 4; i++) {
-                        int x = ix;
-                        int y = iy;
-
-                        if (i == 1) { // Top right
-                            if (x_last && x_odd) continue;
-                            x = ix_mirror;
-                        }
-                        if (i == 2) { // Bottom right
-                            if (x_last && x_odd) continue;
-                            if (y_last && y_odd) continue;
-                            x = ix_mirror;
-                            y = iy_mirror;
-                        }
-                        if (i == 3) { // Bottom left
-                            if (y_last && y_odd) continue;
-                            y = iy_mirror;
-                        }
+        // The inner radius of the stroke on the corners
+        int inner = radius - stroke_width;
+        int inner2 = inner > 0 ? inner * inner : -1;
+        int dx_outer = 0;
+        int dx_inner = 0;
 
-                        if (inverted) {
-                            invertPixel(x, y, fill_inversion);
-                        } else {
-                            size_t idx = 4 * (y * width + x);
-                            data[idx] = fill.r;
-                            data[idx + 1] = fill.g;
-                            data[idx + 2] = fill.b;
-                            data[idx + 3] = fill.a;
-                        }
+        for (int iy = yT, y_pos = 0; iy < yM; iy++, y_pos++) {
+            int iy_mirror = yB - y_pos;
+            bool y_last = iy == yM - 1;
+            bool draw_top = iy >= band_y0 && iy < band_y1;
+            bool draw_bottom = !(y_last && y_odd) && iy_mirror >= band_y0 && iy_mirror < band_y1;
+            if (!draw_top && !draw_bottom) continue;
+            // Up to two spans [a, b) in the left half of the row
+            int spans[2][2];
+            int count = 0;
+            int corner_end = xL; // The corner covers the columns [xL, corner_end)
+            if (iy < ry1) {
+                int dy2 = (iy - ry1) * (iy - ry1);
+                corner_end = std::min(rx1, xM);
+                if (dy2 <= r2) {
+                    // Columns on the corner arc have (ix - rx1)^2 + dy^2 <= radius^2
+                    dx_outer = stepExtent(dx_outer, 1, r2 - dy2);
+                    int a = std::max(rx1 - dx_outer, xL);
+                    int b = corner_end;
+                    if (!doInfill && inner2 >= 0 && dy2 < inner2) {
+                        dx_inner = stepExtent(dx_inner, 1, inner2 - dy2 - 1);
+                        b = std::min(b, rx1 - dx_inner); // Leave the inside of the stroke
+                    }
+                    if (!doInfill && inner2 >= 0 && dy2 >= inner2) b = corner_end;
+                    if (a < b) {
+                        spans[count][0] = a;
+                        spans[count][1] = b;
+                        count++;
                     }
                 }
             }
-            return;
-        }
-        if (doStroke) {
-            for (int iy = yT, y_pos = 0; iy < yM; iy++, y_pos++) {
-                bool visible = 0;
-                bool y_last = iy == yM - 1;
-                for (int ix = xL, x_pos = 0; ix < xM; ix++, x_pos++) {
-                    bool x_last = ix == xM - 1;
-                    bool top_left = (ix < rx1 && iy < ry1);
-                    bool in_rect = !top_left;
-
-                    if (top_left) {
-                        // Get the distance from the center of the rounded corner
-                        float dx = ix - rx1;
-                        float dy = iy - ry1;
-                        float dx2 = dx * dx;
-                        float dy2 = dy * dy;
-                        float dr = sqrtf(dx2 + dy2);
-                        float delta = dr - r;
-                        visible = delta <= 0 && delta >= -stroke_width;
-                    }
-                    if (in_rect) {
-                        // Draw edge lines with a stroke width
-                        bool left = ix < (xL + stroke_width);
-                        bool top = iy < (yT + stroke_width);
-                        visible = left || top;
-                    }
-
-                    if (!visible) continue;
-
-                    int ix_mirror = xR - x_pos;
-                    int iy_mirror = yB - y_pos;
-                    for (int i = 0; i < 4; i++) {
-                        int x = ix;
-                        int y = iy;
-
-                        if (i == 1) { // Top right
-                            if (x_last && x_odd) continue;
-                            x = ix_mirror;
-                        }
-                        if (i == 2) { // Bottom right
-                            if (x_last && x_odd) continue;
-                            if (y_last && y_odd) continue;
-                            x = ix_mirror;
-                            y = iy_mirror;
-                        }
-                        if (i == 3) { // Bottom left
-                            if (y_last && y_odd) continue;
-                            y = iy_mirror;
-                        }
-
-                        if (inverted) {
-                            invertPixel(x, y, stroke_inversion);
-                        } else {
-                            size_t idx = 4 * (y * width + x);
-                            data[idx] = stroke.r;
-                            data[idx + 1] = stroke.g;
-                            data[idx + 2] = stroke.b;
-                            data[idx + 3] = stroke.a;
-                        }
-                    }
+            int a = std::max(corner_end, xL);
+            int b = xM;
+            if (!doInfill && iy >= yT + stroke_width) b = std::min(b, xL + stroke_width); // Only the left edge
+            if (a < b) {
+                if (count > 0 && spans[count - 1][1] == a) spans[count - 1][1] = b;
+                else {
+                    spans[count][0] = a;
+                    spans[count][1] = b;
+                    count++;
+                }
+            }
+            for (int i = 0; i < count; i++) {
+                int s0 = spans[i][0];
+                int s1 = spans[i][1];
+                // Mirror [s0, s1) around the middle, the middle column of odd widths is only drawn once
+                int m0 = xR - (s1 - 1 - xL);
+                int m1 = xR - (s0 - xL) + 1;
+                if (x_odd && s1 == xM) m0++;
+                if (m0 == s1) {
+                    // The span and its mirror touch, draw them as one
+                    if (draw_top) fillSpan(iy, s0, m1, color, inverted);
+                    if (draw_bottom) fillSpan(iy_mirror, s0, m1, color, inverted);
+                    continue;
+                }
+                if (draw_top) {
+                    fillSpan(iy, s0, s1, color, inverted);
+                    fillSpan(iy, m0, m1, color, inverted);
+                }
+                if (draw_bottom) {
+                    fillSpan(iy_mirror, s0, s1, color, inverted);
+                    fillSpan(iy_mirror, m0, m1, color, inverted);
                 }
             }
         }
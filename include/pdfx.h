@@ -0,0 +1,199 @@
+#pragma once
+
+#include <algorithm>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <zlib.h>
+
+#include "tools.h"
+#include "pngx.h"
+#include "tiffx.h"
+
+// PDF document written object by object to a sink, so only the page being drawn is ever held in memory.
+// Pages share one resource dictionary, written at the end, which lists every font and image mask used.
+// Fonts and ^GF bitmaps become their own objects the first time they are used and are referenced from then on,
+// a copy of every distinct bitmap is kept to recognize it by.
+// Object 1 is the catalog, 2 the page tree and 3 the shared resources, all three are written by end()
+class PdfDocument {
+public:
+    PdfDocument(const PngSink& sink, int dpi = 0) : sink(sink) {
+        this->dpi = dpi > 0 ? dpi : TIFF_DEFAULT_DPI;
+    }
+
+    // Write the file header. Blend modes for ^FR need PDF 1.4
+    void begin() {
+        offset = 0;
+        offsets.assign(4, 0);
+        kids.clear();
+        fonts.clear();
+        images.clear();
+        image_index.clear();
+        write("%%PDF-1.4\n%%\xE2\xE3\xCF\xD3\n");
+    }
+
+    // Resource number of a standard Type 1 font, /F<n> in the content
+    int font(const char* base_font) {
+        for (int i = 0; i < (int) fonts.size(); i++) {
+            if (fonts[i].name == base_font) return i + 1;
+        }
+        int number = reserve();
+        startObject(number);
+        write("<< /Type /Font /Subtype /Type1 /BaseFont /%s /Encoding /WinAnsiEncoding >>\nendobj\n", base_font);
+        fonts.push_back({ base_font, number });
+        return (int) fonts.size();
+    }
+
+    // Resource number of an image mask of width x height dots, rows of (width + 7) / 8 bytes with 1 = painted.
+    // Identical bitmaps are stored once, /Im<n> in the content. Returns 0 when it can not be written
+    int image(const uint8_t* bits, int width, int height) {
+        size_t size = (size_t) (width + 7) / 8 * height;
+        // FNV-1a over the dots and the size, a logo repeated on every label hashes to the same key
+        uint64_t key = 14695981039346656037ull;
+        for (size_t i = 0; i < size; i++) key = (key ^ bits[i]) * 1099511628211ull;
+        key = (key ^ (uint64_t) width) * 1099511628211ull;
+        key = (key ^ (uint64_t) height) * 1099511628211ull;
+        auto range = image_index.equal_range(key);
+        for (auto found = range.first; found != range.second; ++found) {
+            const ImageMask& stored = images[found->second - 1];
+            if (stored.width == width && stored.height == height && !memcmp(stored.bits.data(), bits, size)) return found->second;
+        }
+        std::vector<unsigned char> data;
+        if (deflate(bits, size, data)) return 0;
+        int number = reserve();
+        startObject(number);
+        // Decode [1 0] paints the 1 bits, the default would paint the 0 bits
+        write("<< /Type /XObject /Subtype /Image /Width %d /Height %d /ImageMask true /BitsPerComponent 1 /Decode [1 0] /Filter /FlateDecode /Length %d >>\nstream\n",
+            width, height, (int) data.size());
+        writeStream(data);
+        images.push_back({ number, width, height, std::vector<uint8_t>(bits, bits + size) });
+        image_index.emplace(key, (int) images.size());
+        return (int) images.size();
+    }
+
+    // Add a page of width x height dots drawn by the content stream. Copies repeat the page without storing the content again.
+    // Returns 0 on success
+    int page(const std::vector<unsigned char>& content, int width, int height, int copies = 1) {
+        std::vector<unsigned char> data;
+        if (deflate(content.data(), content.size(), data)) return 1;
+        int contents = reserve();
+        startObject(contents);
+        write("<< /Length %d /Filter /FlateDecode >>\nstream\n", (int) data.size());
+        writeStream(data);
+        double scale = 72.0 / dpi;
+        for (int i = 0; i < std::max(1, copies); i++) {
+            int number = reserve();
+            startObject(number);
+            write("<< /Type /Page /Parent 2 0 R /MediaBox [0 0 %g %g] /Resources 3 0 R /Contents %d 0 R >>\nendobj\n",
+                width * scale, height * scale, contents);
+            kids.push_back(number);
+        }
+        return 0;
+    }
+
+    // Write the page tree, the shared resources, the catalog and the cross reference table
+    int end() {
+        if (kids.empty()) {
+            notifyf("Error writing PDF: no pages\n");
+            return 1;
+        }
+        startObject(2);
+        write("<< /Type /Pages /Count %d /Kids [", (int) kids.size());
+        for (size_t i = 0; i < kids.size(); i++) write(i % 16 ? " %d 0 R" : "\n%d 0 R", kids[i]);
+        write("\n] >>\nendobj\n");
+
+        startObject(3);
+        write("<< /ProcSet [/PDF /Text /ImageB] /ExtGState << /GD << /Type /ExtGState /BM /Difference >> >>");
+        if (!fonts.empty()) {
+            write(" /Font <<");
+            for (size_t i = 0; i < fonts.size(); i++) write(" /F%d %d 0 R", (int) i + 1, fonts[i].number);
+            write(" >>");
+        }
+        if (!images.empty()) {
+            write(" /XObject <<");
+            for (size_t i = 0; i < images.size(); i++) write(" /Im%d %d 0 R", (int) i + 1, images[i].number);
+            write(" >>");
+        }
+        write(" >>\nendobj\n");
+
+        startObject(1);
+        write("<< /Type /Catalog /Pages 2 0 R >>\nendobj\n");
+
+        // Every xref entry is exactly 20 bytes
+        size_t xref = offset;
+        write("xref\n0 %d\n0000000000 65535 f \n", (int) offsets.size());
+        for (size_t i = 1; i < offsets.size(); i++) write("%010llu 00000 n \n", (unsigned long long) offsets[i]);
+        write("trailer\n<< /Size %d /Root 1 0 R >>\nstartxref\n%llu\n%%%%EOF\n", (int) offsets.size(), (unsigned long long) xref);
+        return 0;
+    }
+
+    int pages() const {
+        return (int) kids.size();
+    }
+
+private:
+    struct Font {
+        std::string name;
+        int number;
+    };
+
+    struct ImageMask {
+        int number; // Object number of the image mask
+        int width;
+        int height;
+        std::vector<uint8_t> bits;
+    };
+
+    PngSink sink;
+    int dpi;
+    size_t offset = 0; // Bytes written so far
+    std::vector<size_t> offsets; // File offset of every object by number, entry 0 is the free list head
+    std::vector<int> kids; // Page objects in order
+    std::vector<Font> fonts;
+    std::vector<ImageMask> images;
+    std::unordered_multimap<uint64_t, int> image_index; // Bitmap hash to image resource number, checked against the bits
+
+    int reserve() {
+        offsets.push_back(0);
+        return (int) offsets.size() - 1;
+    }
+
+    void startObject(int number) {
+        offsets[number] = offset;
+        write("%d 0 obj\n", number);
+    }
+
+    void emit(const unsigned char* data, size_t size) {
+        sink(data, size);
+        offset += size;
+    }
+
+    void write(const char* format, ...) {
+        char buffer[512];
+        va_list args;
+        va_start(args, format);
+        int length = vsnprintf(buffer, sizeof(buffer), format, args);
+        va_end(args);
+        if (length > 0) emit((const unsigned char*) buffer, std::min(length, (int) sizeof(buffer) - 1));
+    }
+
+    void writeStream(const std::vector<unsigned char>& data) {
+        emit(data.data(), data.size());
+        write("\nendstream\nendobj\n");
+    }
+
+    static int deflate(const unsigned char* data, size_t size, std::vector<unsigned char>& out) {
+        uLongf length = compressBound(size);
+        out.resize(length);
+        if (compress2(out.data(), &length, data, size, Z_DEFAULT_COMPRESSION) != Z_OK) {
+            notifyf("Error writing PDF: deflate failed\n");
+            return 1;
+        }
+        out.resize(length);
+        return 0;
+    }
+};
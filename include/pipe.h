@@ -1,15 +1,28 @@
 #pragma once
 
+#include <errno.h>
 #include "tools.h"
 
-std::string getPipe() {
-    std::string data;
-    if (!isatty(fileno(stdin))) { // Check if there's data in the pipe
-        if (std::cin.peek() != EOF) { // Check if there's any data available
-            std::ostringstream buffer;
-            buffer << std::cin.rdbuf();  // Read all available data from the pipe
-            data = buffer.str();
+// Reads stdin a chunk at a time as the data arrives, so ZPL piped in or forwarded from a socket can be converted
+// while the rest of it is still being sent
+struct PipeReader {
+    std::vector<char> buffer = std::vector<char>(64 * 1024);
+    size_t length = 0; // Bytes of the last chunk
+
+    // Wait for the next chunk, false once the input is closed or when stdin is a terminal
+    bool next() {
+        length = 0;
+        if (isatty(fileno(stdin))) return false;
+        while (true) {
+            int n = read(fileno(stdin), buffer.data(), (unsigned) buffer.size());
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            length = n;
+            return true;
         }
     }
-    return data;
-}
\ No newline at end of file
+
+    const char* data() const {
+        return buffer.data();
+    }
+};
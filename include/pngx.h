@@ -0,0 +1,647 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <deque>
+#include <functional>
+#include <vector>
+#include <zlib.h>
+
+#include "tools.h"
+#include "lodepng.h"
+#include "fpng.h"
+#include "thread_pool.h"
+
+enum PNG_ENCODER {
+    PE_UNKNOWN,
+    PE_LODEPNG,
+    PE_FPNG,
+    PE_AUTO, // Monochrome images are sampled to pick the filter and deflate settings, RGBA images use PE_LODEPNG
+};
+
+enum FPNG_FLAGS {
+    // Enables computing custom Huffman tables for each file, instead of using the custom global tables.
+    // Results in roughly 6% smaller files on average, but compression is around 40% slower.
+    FPNG_ENCODE_SLOWER = 1,
+    // Only use raw Deflate blocks (no compression at all). Intended for testing.
+    FPNG_FORCE_UNCOMPRESSED = 2,
+};
+
+// Deflate implementation behind PE_LODEPNG
+enum PNG_DEFLATE {
+    PD_LODEPNG, // lodepng's built in deflate
+    PD_ZLIB, // The system zlib at zlib_level with zlib_strategy, through lodepng's custom_zlib hook
+};
+
+#define PNG_STREAM_CHUNK 65536 // Bytes of deflate output per IDAT chunk when streaming
+#define PNG_PIECE_MIN 65536 // Smallest amount of scanline bytes worth deflating on a separate core
+#define PNG_WINDOW 32768 // Deflate window, the most a piece can reference from the rows before it
+
+// Receives the PNG bytes in order as they are produced
+typedef std::function<void(const unsigned char* data, size_t size)> PngSink;
+
+void png_put32(std::vector<unsigned char>& out, size_t at, uint32_t value) {
+    out[at + 0] = (value >> 24) & 0xFF;
+    out[at + 1] = (value >> 16) & 0xFF;
+    out[at + 2] = (value >> 8) & 0xFF;
+    out[at + 3] = value & 0xFF;
+}
+
+// Append the chunk header for a chunk of the given length, the data follows at out.size()
+void png_beginChunk(std::vector<unsigned char>& out, const char* type, uint32_t length) {
+    size_t at = out.size();
+    out.resize(at + 8);
+    png_put32(out, at, length);
+    memcpy(&out[at + 4], type, 4);
+}
+
+// Append the CRC of the chunk that starts at the given offset, covering its type and data
+void png_endChunk(std::vector<unsigned char>& out, size_t chunk_start) {
+    uLong crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, &out[chunk_start + 4], out.size() - chunk_start - 4);
+    size_t at = out.size();
+    out.resize(at + 4);
+    png_put32(out, at, crc);
+}
+
+// Convert packed 1 bpp rows (MSB first, 1 = black) to grayscale scanlines: filter type 0 followed by the inverted row,
+// the padding bits of the last byte are left 0. dst needs count * ((width + 7) / 8 + 1) bytes
+void png_monoScanlines(uint8_t* dst, const uint8_t* rows, int stride, int count, int width) {
+    int row_bytes = (width + 7) / 8;
+    uint8_t last_mask = width % 8 ? 0xFF << (8 - width % 8) : 0xFF;
+    for (int y = 0; y < count; y++) {
+        const uint8_t* row = rows + (size_t) y * stride;
+        *dst++ = 0;
+        for (int i = 0; i < row_bytes; i++) dst[i] = ~row[i];
+        dst[row_bytes - 1] &= last_mask;
+        dst += row_bytes;
+    }
+}
+
+// What PE_AUTO measured on a monochrome image and the settings it picked
+struct PngAutoPlan {
+    int rows = 0; // Rows sampled
+    int blank_rows = 0; // Sampled rows without a black pixel
+    int repeated_rows = 0; // Sampled rows identical to the row above
+    int run_length = 0; // Average pixels per run of one color in the sampled rows that are not blank or repeated
+    bool filter_up = false; // Up filter instead of None on every row but the first
+    int level = Z_DEFAULT_COMPRESSION;
+    int strategy = Z_DEFAULT_STRATEGY;
+};
+
+// Color changes along a packed row, counting the edge of the row as white
+int png_transitions(const uint8_t* row, int row_bytes) {
+    int count = 0;
+    int carry = 0;
+    for (int i = 0; i < row_bytes; i++) {
+        uint8_t byte = row[i];
+        uint8_t x = byte ^ ((byte >> 1) | (carry << 7));
+        carry = byte & 1;
+        x = x - ((x >> 1) & 0x55);
+        x = (x & 0x33) + ((x >> 2) & 0x33);
+        count += (x + (x >> 4)) & 0x0F;
+    }
+    return count;
+}
+
+// PNG encoder that is set up once and reused for every label. The zlib streams, fpng's tables and the scanline
+// buffers stay allocated between calls, so encoding monochrome labels back to back into the same output does not allocate.
+// Monochrome images are written as 1 bit grayscale (color type 0, bit depth 1), 1/32 of the bytes an RGBA buffer would take
+class PngEncoder {
+public:
+    int fpng_flags = FPNG_ENCODE_SLOWER; // FPNG_FLAGS for RGBA images in PE_FPNG mode
+    int mono_level = Z_BEST_SPEED; // Deflate level for monochrome images in PE_FPNG mode
+    int threads = 0; // Pieces a monochrome image is deflated in at most, 0 = one per core, 1 = a single stream
+    PNG_DEFLATE deflate_backend = PD_LODEPNG; // Deflate used in PE_LODEPNG mode
+    int zlib_level = Z_BEST_COMPRESSION; // Used by PD_ZLIB
+    int zlib_strategy = Z_DEFAULT_STRATEGY; // Used by PD_ZLIB, Z_RLE and Z_FILTERED suit bilevel labels
+    int auto_effort = 6; // PE_AUTO trade-off from 1 (fastest) to 9 (smallest)
+    PngAutoPlan auto_plan; // Settings PE_AUTO picked for the last monochrome image
+
+    // Take over the settings of another encoder, for example one per worker thread, without its streams and buffers
+    void copySettings(const PngEncoder& other) {
+        fpng_flags = other.fpng_flags;
+        mono_level = other.mono_level;
+        threads = other.threads;
+        deflate_backend = other.deflate_backend;
+        zlib_level = other.zlib_level;
+        zlib_strategy = other.zlib_strategy;
+        auto_effort = other.auto_effort;
+    }
+
+    ~PngEncoder() {
+        if (stream_ready) deflateEnd(&stream);
+        if (zlib_ready) deflateEnd(&zlib_stream);
+        for (Piece& piece : pieces) {
+            if (piece.ready) deflateEnd(&piece.stream);
+        }
+    }
+
+    // Encode width x height pixels into out (replacing its contents). Monochrome pixels are packed 1 bpp rows, MSB first with 1 = black,
+    // otherwise 4 bytes per pixel RGBA. Returns 0 on success
+    int encode(const uint8_t* pixels, int stride, int width, int height, bool mono, PNG_ENCODER mode, std::vector<unsigned char>& out) {
+        out.clear();
+        if (width <= 0 || height <= 0) {
+            notifyf("Error encoding PNG: empty image\n");
+            return 1;
+        }
+        if (mode == PE_LODEPNG || (mode == PE_AUTO && !mono)) return encodeLodepng(pixels, stride, width, height, mono, out);
+        if (mode == PE_AUTO) return encodeAuto(pixels, stride, width, height, out);
+        if (mode == PE_FPNG) {
+            if (mono) return encodeMono(pixels, stride, width, height, out);
+            if (!fpng_ready) {
+                fpng::fpng_init();
+                fpng_ready = true;
+            }
+            if (!fpng::fpng_encode_image_to_memory(pixels, width, height, 4, out, fpng_flags)) {
+                notifyf("Error encoding PNG\n");
+                return 1;
+            }
+            return 0;
+        }
+        notifyf("Unknown PNG encoder %d\n", mode);
+        return 1;
+    }
+
+    // Number of pieces worth deflating in parallel for count rows of the given width, 1 when a single stream is better
+    int pieceCount(int width, int count) {
+        size_t raw_size = (size_t) ((width + 7) / 8 + 1) * count;
+        int limit = threads > 0 ? threads : thread_pool.size();
+        return (int) std::max((size_t) 1, std::min((size_t) limit, raw_size / PNG_PIECE_MIN));
+    }
+
+    // Streaming monochrome output: beginStream, the rows top to bottom, then endStream.
+    // IDAT chunks reach the sink as soon as they fill up, so the whole image never has to be held at once.
+    // With piece_count 0 the rows go through streamRows into a single deflate stream. Otherwise they are split into pieces
+    // that deflatePiece compresses independently (pigz style, each piece may run on its own thread) and writePiece
+    // appends in order. All calls return 0 on success
+    int beginStream(int width, int height, const PngSink& sink, int piece_count = 0) {
+        if (width <= 0 || height <= 0) {
+            notifyf("Error encoding PNG: empty image\n");
+            return 1;
+        }
+        writeHeader(width, height, sink);
+        parallel = piece_count > 0;
+        if (!parallel) return resetStream(mono_level, Z_DEFAULT_STRATEGY);
+
+        // The pieces are raw deflate data, the zlib header and the Adler-32 around them are written here
+        while ((int) pieces.size() < piece_count) pieces.emplace_back();
+        for (int i = 0; i < piece_count; i++) {
+            Piece& piece = pieces[i];
+            if (piece.ready && piece.level == mono_level) continue;
+            if (piece.ready) deflateEnd(&piece.stream);
+            memset(&piece.stream, 0, sizeof(piece.stream));
+            piece.ready = deflateInit2(&piece.stream, mono_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+            piece.level = mono_level;
+            if (!piece.ready) {
+                notifyf("Error encoding PNG: zlib init failed\n");
+                return 1;
+            }
+        }
+        int level_flag = mono_level < 2 ? 0 : mono_level < 6 ? 1 : mono_level == 6 ? 2 : 3;
+        unsigned char header[2] = { 0x78, (unsigned char) (level_flag << 6) };
+        header[1] += 31 - ((header[0] << 8) + header[1]) % 31;
+        put(header, 2);
+        adler = adler32(0L, Z_NULL, 0);
+        return 0;
+    }
+
+    // Add the next count packed 1 bpp rows (MSB first, 1 = black) to a single stream
+    int streamRows(const uint8_t* rows, int stride, int count) {
+        count = std::min(count, stream_rows_left);
+        stream_rows_left -= count;
+        // Converted a slice at a time so scratch stays small
+        int row_bytes = (stream_width + 7) / 8;
+        int slice = std::max(1, PNG_STREAM_CHUNK / (row_bytes + 1));
+        for (int y0 = 0; y0 < count; y0 += slice) {
+            int n = std::min(slice, count - y0);
+            scratch.resize((size_t) (row_bytes + 1) * n);
+            png_monoScanlines(scratch.data(), rows + (size_t) y0 * stride, stride, n, stream_width);
+            stream.next_in = scratch.data();
+            stream.avail_in = scratch.size();
+            if (pump(Z_NO_FLUSH)) return 1;
+        }
+        return 0;
+    }
+
+    // Compress count rows as piece i of a parallel stream. The previous_count rows right before them (same stride) prime
+    // the deflate window so the piece compresses almost as well as a single stream. Pieces other than the last end on a
+    // byte boundary with a sync flush, so their outputs can simply be concatenated. Different pieces may run at the same time
+    int deflatePiece(int i, const uint8_t* rows, int stride, int count, const uint8_t* previous, int previous_count, bool last) {
+        Piece& piece = pieces[i];
+        int line = (stream_width + 7) / 8 + 1;
+        piece.raw.resize((size_t) line * count);
+        png_monoScanlines(piece.raw.data(), rows, stride, count, stream_width);
+        piece.rows = count;
+        piece.adler = adler32(adler32(0L, Z_NULL, 0), piece.raw.data(), piece.raw.size());
+
+        z_stream& s = piece.stream;
+        deflateReset(&s);
+        previous_count = std::min(previous_count, PNG_WINDOW / line);
+        if (previous && previous_count > 0) {
+            piece.dictionary.resize((size_t) line * previous_count);
+            png_monoScanlines(piece.dictionary.data(), previous - (size_t) previous_count * stride, stride, previous_count, stream_width);
+            deflateSetDictionary(&s, piece.dictionary.data(), piece.dictionary.size());
+        }
+        piece.out.resize(deflateBound(&s, piece.raw.size()) + 16);
+        s.next_in = piece.raw.data();
+        s.avail_in = piece.raw.size();
+        s.next_out = piece.out.data();
+        s.avail_out = piece.out.size();
+        int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+        while (true) {
+            int result = deflate(&s, flush);
+            if (result == Z_STREAM_ERROR) {
+                piece.error = 1;
+                return 1;
+            }
+            bool done = last ? result == Z_STREAM_END : s.avail_in == 0 && s.avail_out > 0;
+            if (done) break;
+            // Out of room, grow the buffer and continue where deflate left off
+            size_t used = piece.out.size() - s.avail_out;
+            piece.out.resize(piece.out.size() * 2);
+            s.next_out = piece.out.data() + used;
+            s.avail_out = piece.out.size() - used;
+        }
+        piece.out.resize(piece.out.size() - s.avail_out);
+        piece.error = 0;
+        return 0;
+    }
+
+    // Append piece i to the output, pieces have to be written in image order
+    int writePiece(int i) {
+        Piece& piece = pieces[i];
+        if (piece.error) {
+            notifyf("Error encoding PNG: deflate failed\n");
+            return 1;
+        }
+        put(piece.out.data(), piece.out.size());
+        adler = adler32_combine(adler, piece.adler, piece.raw.size());
+        stream_rows_left -= piece.rows;
+        return 0;
+    }
+
+    int endStream() {
+        if (stream_rows_left != 0) {
+            notifyf("Error encoding PNG: %d rows missing\n", stream_rows_left);
+            return 1;
+        }
+        if (parallel) {
+            unsigned char trailer[4] = { (unsigned char) (adler >> 24), (unsigned char) (adler >> 16), (unsigned char) (adler >> 8), (unsigned char) adler };
+            put(trailer, 4);
+            emitChunk(chunk_fill);
+        } else {
+            stream.next_in = nullptr;
+            stream.avail_in = 0;
+            if (pump(Z_FINISH)) return 1;
+        }
+        head.clear();
+        png_beginChunk(head, "IEND", 0);
+        png_endChunk(head, 0);
+        sink(head.data(), head.size());
+        sink = nullptr;
+        return 0;
+    }
+
+private:
+    // Independently compressed part of a parallel stream
+    struct Piece {
+        z_stream stream;
+        bool ready = false;
+        int level = 0;
+        int error = 0;
+        int rows = 0;
+        uLong adler = 0; // Adler-32 of raw
+        std::vector<unsigned char> raw; // Scanlines
+        std::vector<unsigned char> dictionary; // Scanlines of the rows before the piece
+        std::vector<unsigned char> out; // Raw deflate data
+    };
+
+    z_stream stream;
+    bool stream_ready = false;
+    int stream_level = 0;
+    int stream_strategy = Z_DEFAULT_STRATEGY;
+    bool fpng_ready = false;
+    z_stream zlib_stream; // Stream behind the custom_zlib hook and PE_AUTO's trials, reset for every use
+    bool zlib_ready = false;
+    std::vector<unsigned char> trial; // Output of PE_AUTO's trials
+    std::vector<unsigned char> scratch; // Scanlines or repacked bits handed to the compressor
+    std::deque<Piece> pieces; // zlib keeps pointers into the z_stream, so pieces must not move
+    PngSink sink; // Output of the stream in progress
+    bool parallel = false;
+    uLong adler = 0; // Running Adler-32 of a parallel stream
+    int stream_width = 0;
+    int stream_rows_left = 0;
+    std::vector<unsigned char> head; // Signature, IHDR and IEND
+    std::vector<unsigned char> chunk; // IDAT chunk being filled: length, type, up to PNG_STREAM_CHUNK bytes, CRC
+    size_t chunk_fill = 0; // Data bytes in chunk, for parallel streams
+
+    // lodepng custom_zlib hook: compress a whole zlib stream with the system zlib, custom_context is the encoder.
+    // lodepng frees the output with free()
+    static unsigned zlibHook(unsigned char** out, size_t* out_size, const unsigned char* in, size_t in_size, const LodePNGCompressSettings* settings) {
+        PngEncoder* encoder = (PngEncoder*) settings->custom_context;
+        if (encoder->resetZlib(encoder->zlib_level, encoder->zlib_strategy)) return 111;
+        z_stream& s = encoder->zlib_stream;
+        size_t bound = deflateBound(&s, in_size);
+        unsigned char* buffer = (unsigned char*) malloc(bound);
+        if (!buffer) return 83; // lodepng's allocation error
+        s.next_in = (Bytef*) in;
+        s.avail_in = in_size;
+        s.next_out = buffer;
+        s.avail_out = bound;
+        if (deflate(&s, Z_FINISH) != Z_STREAM_END) {
+            free(buffer);
+            return 111;
+        }
+        *out = buffer;
+        *out_size = bound - s.avail_out;
+        return 0;
+    }
+
+    // Reset the stream shared by the custom_zlib hook and PE_AUTO's trials
+    int resetZlib(int level, int strategy) {
+        if (!zlib_ready) {
+            memset(&zlib_stream, 0, sizeof(zlib_stream));
+            if (deflateInit2(&zlib_stream, level, Z_DEFLATED, 15, 8, strategy) != Z_OK) return 1;
+            zlib_ready = true;
+        } else {
+            deflateReset(&zlib_stream);
+            deflateParams(&zlib_stream, level, strategy);
+        }
+        return 0;
+    }
+
+    int encodeLodepng(const uint8_t* pixels, int stride, int width, int height, bool mono, std::vector<unsigned char>& out) {
+        unsigned error = 0;
+        lodepng::State state;
+        if (deflate_backend == PD_ZLIB) {
+            state.encoder.zlibsettings.custom_zlib = zlibHook;
+            state.encoder.zlibsettings.custom_context = this;
+        }
+        if (mono) {
+            // Encode the packed bits directly as 1 bit grayscale, skipping lodepng's color analysis and conversion.
+            // lodepng expects no padding bits between rows and 0 = black, so the rows are inverted into scratch
+            state.info_raw.colortype = LCT_GREY;
+            state.info_raw.bitdepth = 1;
+            state.info_png.color.colortype = LCT_GREY;
+            state.info_png.color.bitdepth = 1;
+            state.encoder.auto_convert = 0;
+            scratch.assign(((size_t) width * height + 7) / 8 + 1, 0);
+            int row_bytes = (width + 7) / 8;
+            int tail = width % 8;
+            uint8_t last_mask = tail ? 0xFF << (8 - tail) : 0xFF;
+            for (int y = 0; y < height; y++) {
+                const uint8_t* row = pixels + (size_t) y * stride;
+                size_t bit = (size_t) y * width;
+                uint8_t* dst = &scratch[bit >> 3];
+                int shift = bit & 7;
+                if (shift == 0) {
+                    for (int i = 0; i < row_bytes; i++) dst[i] = ~row[i];
+                    dst[row_bytes - 1] &= last_mask;
+                    continue;
+                }
+                for (int i = 0; i < row_bytes; i++) {
+                    uint8_t byte = ~row[i];
+                    if (i == row_bytes - 1) byte &= last_mask;
+                    dst[i] |= byte >> shift;
+                    dst[i + 1] |= byte << (8 - shift);
+                }
+            }
+            error = lodepng::encode(out, scratch.data(), width, height, state);
+        } else {
+            error = lodepng::encode(out, pixels, width, height, state);
+        }
+        if (error) {
+            notifyf("Error encoding PNG: %s\n", lodepng_error_text(error));
+            return 1;
+        }
+        return 0;
+    }
+
+    int encodeMono(const uint8_t* pixels, int stride, int width, int height, std::vector<unsigned char>& out) {
+        PngSink sink = [&](const unsigned char* data, size_t size) { out.insert(out.end(), data, data + size); };
+        int count = pieceCount(width, height);
+        if (count <= 1) {
+            if (beginStream(width, height, sink)) return 1;
+            if (streamRows(pixels, stride, height)) return 1;
+            return endStream();
+        }
+        // Split the rows evenly and deflate the pieces on the thread pool, each primed with the rows right before it
+        if (beginStream(width, height, sink, count)) return 1;
+        int rows = (height + count - 1) / count;
+        thread_pool.run(count, [&](int i) {
+            int y0 = std::min(i * rows, height);
+            int y1 = std::min(y0 + rows, height);
+            const uint8_t* first = pixels + (size_t) y0 * stride;
+            deflatePiece(i, first, stride, y1 - y0, first, y0, i == count - 1);
+        });
+        for (int i = 0; i < count; i++) {
+            if (writePiece(i)) return 1;
+        }
+        return endStream();
+    }
+
+    // Sample the rows of a monochrome image and pick the filter and deflate settings for it
+    PngAutoPlan planMono(const uint8_t* pixels, int stride, int width, int height) {
+        PngAutoPlan plan;
+        int row_bytes = (width + 7) / 8;
+        int step = std::max(1, height / 256);
+        long transitions = 0;
+        int busy_rows = 0;
+        int busiest_y = 0;
+        int busiest = 0;
+        for (int y = 0; y < height; y += step) {
+            const uint8_t* row = pixels + (size_t) y * stride;
+            plan.rows++;
+            if (y > 0 && memcmp(row, row - stride, row_bytes) == 0) {
+                plan.repeated_rows++;
+                continue;
+            }
+            int count = png_transitions(row, row_bytes);
+            if (count == 0) {
+                plan.blank_rows++;
+                continue;
+            }
+            busy_rows++;
+            transitions += count;
+            if (count > busiest) {
+                busiest = count;
+                busiest_y = y;
+            }
+        }
+        plan.run_length = busy_rows ? (int) ((long) width * busy_rows / (transitions + busy_rows)) : width;
+        // Deflate already matches a row against the one above, so counting the zeros Up would produce says little.
+        // Instead the stretch of rows around the busiest one is deflated both ways at the fastest level
+        if (busy_rows > 0) {
+            int count = std::min(height, std::max(2, PNG_WINDOW / 2 / (row_bytes + 1)));
+            int y0 = std::max(0, std::min(busiest_y - count / 2, height - count));
+            size_t none = trialSize(pixels, stride, width, y0, count, false);
+            size_t up = trialSize(pixels, stride, width, y0, count, true);
+            plan.filter_up = up < none;
+        }
+        // Dense graphics and halftones (mostly ^GF images) have short runs and few repeated or blank rows. They get a
+        // lower level and Z_FILTERED, which favours literals over the short matches that are costly to search for
+        bool dense = busy_rows * 2 > plan.rows && plan.run_length < 8;
+        if (auto_effort >= 8) plan.level = Z_BEST_COMPRESSION;
+        else if (auto_effort <= 2) plan.level = Z_BEST_SPEED;
+        else plan.level = dense ? auto_effort - 2 : auto_effort;
+        plan.strategy = dense ? Z_FILTERED : Z_DEFAULT_STRATEGY;
+        return plan;
+    }
+
+    // Scanlines for count rows starting at y0 into dst. Rows identical to the one above skip the per byte work:
+    // with Up they are all zeros, without a filter the previous scanline is copied
+    void filterRows(uint8_t* dst, const uint8_t* pixels, int stride, int width, int y0, int count, bool up) {
+        int row_bytes = (width + 7) / 8;
+        uint8_t last_mask = width % 8 ? 0xFF << (8 - width % 8) : 0xFF;
+        for (int y = y0; y < y0 + count; y++) {
+            const uint8_t* row = pixels + (size_t) y * stride;
+            const uint8_t* above = row - stride;
+            bool repeated = y > 0 && memcmp(row, above, row_bytes) == 0;
+            if (repeated && up) {
+                *dst++ = 2;
+                memset(dst, 0, row_bytes);
+            } else if (repeated && y > y0) {
+                memcpy(dst, dst - row_bytes - 1, row_bytes + 1);
+                dst++;
+            } else if (y > 0 && up) {
+                // Up on inverted bits: ~row - ~above = above - row
+                *dst++ = 2;
+                for (int i = 0; i < row_bytes; i++) dst[i] = above[i] - row[i];
+                dst[row_bytes - 1] = (above[row_bytes - 1] & last_mask) - (row[row_bytes - 1] & last_mask);
+            } else {
+                *dst++ = 0;
+                for (int i = 0; i < row_bytes; i++) dst[i] = ~row[i];
+                dst[row_bytes - 1] &= last_mask;
+            }
+            dst += row_bytes;
+        }
+    }
+
+    // Deflated size of count rows starting at y0 with the given filter, at the fastest level
+    size_t trialSize(const uint8_t* pixels, int stride, int width, int y0, int count, bool up) {
+        scratch.resize((size_t) ((width + 7) / 8 + 1) * count);
+        filterRows(scratch.data(), pixels, stride, width, y0, count, up);
+        if (resetZlib(Z_BEST_SPEED, Z_DEFAULT_STRATEGY)) return 0;
+        trial.resize(deflateBound(&zlib_stream, scratch.size()));
+        zlib_stream.next_in = scratch.data();
+        zlib_stream.avail_in = scratch.size();
+        zlib_stream.next_out = trial.data();
+        zlib_stream.avail_out = trial.size();
+        deflate(&zlib_stream, Z_FINISH);
+        return trial.size() - zlib_stream.avail_out;
+    }
+
+    // PE_AUTO for monochrome images, with the filter, level and strategy planMono picked
+    int encodeAuto(const uint8_t* pixels, int stride, int width, int height, std::vector<unsigned char>& out) {
+        auto_plan = planMono(pixels, stride, width, height);
+        PngSink sink = [&](const unsigned char* data, size_t size) { out.insert(out.end(), data, data + size); };
+        writeHeader(width, height, sink);
+        parallel = false;
+        if (resetStream(auto_plan.level, auto_plan.strategy)) return 1;
+        int line = (width + 7) / 8 + 1;
+        int slice = std::max(1, PNG_STREAM_CHUNK / line);
+        for (int y0 = 0; y0 < height; y0 += slice) {
+            int n = std::min(slice, height - y0);
+            scratch.resize((size_t) line * n);
+            filterRows(scratch.data(), pixels, stride, width, y0, n, auto_plan.filter_up);
+            stream.next_in = scratch.data();
+            stream.avail_in = scratch.size();
+            if (pump(Z_NO_FLUSH)) return 1;
+        }
+        stream_rows_left = 0;
+        return endStream();
+    }
+
+    // Write the signature and IHDR of a 1 bit grayscale image to the sink and get ready for its IDAT chunks
+    void writeHeader(int width, int height, const PngSink& sink) {
+        this->sink = sink;
+        stream_width = width;
+        stream_rows_left = height;
+
+        static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+        head.assign(signature, signature + 8);
+        png_beginChunk(head, "IHDR", 13);
+        size_t at = head.size();
+        head.resize(at + 13);
+        png_put32(head, at, width);
+        png_put32(head, at + 4, height);
+        head[at + 8] = 1; // Bit depth
+        head[at + 9] = 0; // Grayscale
+        head[at + 10] = 0; // Deflate
+        head[at + 11] = 0; // Adaptive filtering
+        head[at + 12] = 0; // Not interlaced
+        png_endChunk(head, 8);
+        this->sink(head.data(), head.size());
+
+        chunk.resize(8 + PNG_STREAM_CHUNK + 4);
+        memcpy(&chunk[4], "IDAT", 4);
+        chunk_fill = 0;
+    }
+
+    // Reset the single stream for a new image. It is only initialized once, later images keep zlib's window and hash tables
+    int resetStream(int level, int strategy) {
+        if (!stream_ready) {
+            memset(&stream, 0, sizeof(stream));
+            int result = deflateInit2(&stream, level, Z_DEFLATED, 15, 8, strategy);
+            if (result != Z_OK) {
+                notifyf("Error encoding PNG: zlib error %d\n", result);
+                return 1;
+            }
+            stream_ready = true;
+        } else {
+            deflateReset(&stream);
+            if (stream_level != level || stream_strategy != strategy) deflateParams(&stream, level, strategy);
+        }
+        stream_level = level;
+        stream_strategy = strategy;
+        stream.next_out = &chunk[8];
+        stream.avail_out = PNG_STREAM_CHUNK;
+        return 0;
+    }
+
+    // Append bytes to the IDAT data of a parallel stream, handing every full chunk to the sink
+    void put(const unsigned char* data, size_t size) {
+        while (size > 0) {
+            size_t n = std::min(size, (size_t) PNG_STREAM_CHUNK - chunk_fill);
+            memcpy(&chunk[8 + chunk_fill], data, n);
+            chunk_fill += n;
+            data += n;
+            size -= n;
+            if (chunk_fill == PNG_STREAM_CHUNK) {
+                emitChunk(chunk_fill);
+                chunk_fill = 0;
+            }
+        }
+    }
+
+    // Run a single stream's deflate over its pending input, a chunk is only handed to the sink once it is full
+    // unless finishing
+    int pump(int flush) {
+        while (true) {
+            int result = deflate(&stream, flush);
+            if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+                notifyf("Error encoding PNG: zlib error %d\n", result);
+                return 1;
+            }
+            bool done = flush == Z_FINISH ? result == Z_STREAM_END : stream.avail_in == 0 && stream.avail_out > 0;
+            if (stream.avail_out == 0 || (done && flush == Z_FINISH)) {
+                emitChunk(PNG_STREAM_CHUNK - stream.avail_out);
+                stream.next_out = &chunk[8];
+                stream.avail_out = PNG_STREAM_CHUNK;
+            }
+            if (done) return 0;
+        }
+    }
+
+    // Hand the IDAT chunk with the first length data bytes of chunk to the sink
+    void emitChunk(size_t length) {
+        if (length == 0) return;
+        png_put32(chunk, 0, length);
+        uLong crc = crc32(0L, Z_NULL, 0);
+        crc = crc32(crc, &chunk[4], length + 4);
+        png_put32(chunk, 8 + length, crc);
+        sink(chunk.data(), 12 + length);
+    }
+};
+
@@ -0,0 +1,215 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "tools.h"
+#include "tiffx.h"
+
+// Image file written for a label. PBM, PGM and BMP are written straight from the raster without compression
+enum OUTPUT_FORMAT {
+    OF_UNKNOWN,
+    OF_PNG,
+    OF_PBM, // Binary portable bitmap (P4), 1 bit per pixel with 1 = black, the same layout as a monochrome raster
+    OF_PGM, // Binary portable graymap (P5), 1 byte per pixel
+    OF_BMP, // Windows bitmap, 1 bit with a palette for monochrome images, 24 bit otherwise
+    OF_TIFF, // Bilevel TIFF with CCITT Group 4 compression, for archiving
+    OF_SVG, // Vector output of the label elements, see VectorWriter
+    OF_EPS,
+    OF_PDF, // Vector pages, one per label and copy, see PdfDocument
+    OF_ZPL, // A label holding the image as one ^GF graphic in ZPL's ASCII compression
+};
+
+OUTPUT_FORMAT outputFormat(const std::string& name) {
+    if (name == "png") return OF_PNG;
+    if (name == "pbm") return OF_PBM;
+    if (name == "pgm") return OF_PGM;
+    if (name == "bmp") return OF_BMP;
+    if (name == "tif" || name == "tiff") return OF_TIFF;
+    if (name == "svg") return OF_SVG;
+    if (name == "eps") return OF_EPS;
+    if (name == "pdf") return OF_PDF;
+    if (name == "zpl") return OF_ZPL;
+    return OF_UNKNOWN;
+}
+
+const char* outputExtension(OUTPUT_FORMAT format) {
+    switch (format) {
+        case OF_PBM: return ".pbm";
+        case OF_PGM: return ".pgm";
+        case OF_BMP: return ".bmp";
+        case OF_TIFF: return ".tif";
+        case OF_SVG: return ".svg";
+        case OF_EPS: return ".eps";
+        case OF_PDF: return ".pdf";
+        case OF_ZPL: return ".gf.zpl"; // Not to overwrite the source label
+        default: return ".png";
+    }
+}
+
+void raster_put16le(uint8_t* at, uint32_t value) {
+    at[0] = value & 0xFF;
+    at[1] = (value >> 8) & 0xFF;
+}
+
+void raster_put32le(uint8_t* at, uint32_t value) {
+    raster_put16le(at, value & 0xFFFF);
+    raster_put16le(at + 2, value >> 16);
+}
+
+// Luminance of an RGBA pixel
+uint8_t raster_gray(const uint8_t* pixel) {
+    return (pixel[0] * 77 + pixel[1] * 150 + pixel[2] * 29) >> 8;
+}
+
+// Packed 1 bpp copy of row y, RGBA pixels darker than mid gray are black
+void raster_monoRow(const uint8_t* pixels, int stride, int width, int y, bool mono, uint8_t* dst) {
+    const uint8_t* row = pixels + (size_t) y * stride;
+    int row_bytes = (width + 7) / 8;
+    if (mono) {
+        memcpy(dst, row, row_bytes);
+        if (width % 8) dst[row_bytes - 1] &= 0xFF << (8 - width % 8);
+        return;
+    }
+    memset(dst, 0, row_bytes);
+    for (int x = 0; x < width; x++) {
+        if (raster_gray(row + x * 4) < 128) dst[x >> 3] |= 0x80 >> (x & 7);
+    }
+}
+
+// Append a ^GF row in ZPL's ASCII compression: a run of the same hex digit is written once after its count, where g to z
+// count 20 to 400 and G to Y 1 to 19, and a row ending in zeros or ones ends with ',' or '!'
+void raster_gfRow(const uint8_t* row, int row_bytes, std::string& out) {
+    static const char hex[] = "0123456789ABCDEF";
+    int digits = row_bytes * 2;
+    auto digit = [&](int i) { return hex[(row[i >> 1] >> (i & 1 ? 0 : 4)) & 15]; };
+    int end = digits;
+    char tail = 0;
+    while (end > 0 && digit(end - 1) == '0') end--;
+    if (end < digits) {
+        tail = ',';
+    } else {
+        while (end > 0 && digit(end - 1) == 'F') end--;
+        if (end < digits) tail = '!';
+    }
+    for (int i = 0; i < end;) {
+        char c = digit(i);
+        int count = 1;
+        while (i + count < end && digit(i + count) == c) count++;
+        i += count;
+        if (count <= 2) {
+            out.append(count, c);
+            continue;
+        }
+        for (; count >= 400; count -= 400) out.push_back('z');
+        if (count >= 20) out.push_back('g' + count / 20 - 1);
+        if (count % 20) out.push_back('G' + count % 20 - 1);
+        out.push_back(c);
+    }
+    if (tail) out.push_back(tail);
+}
+
+// Write width x height pixels as PBM, PGM, BMP, TIFF or a ^GF label into out (replacing its contents). Monochrome pixels are packed 1 bpp rows,
+// MSB first with 1 = black, otherwise 4 bytes per pixel RGBA. RGBA pixels darker than mid gray are black in a PBM, TIFF or ^GF.
+// dpi only goes into the TIFF header. Returns 0 on success
+int encodeRaster(const uint8_t* pixels, int stride, int width, int height, bool mono, OUTPUT_FORMAT format, std::vector<unsigned char>& out, int dpi = 0) {
+    if (format == OF_TIFF) return encodeTiffG4(pixels, stride, width, height, mono, dpi, out);
+    out.clear();
+    if (width <= 0 || height <= 0) {
+        notifyf("Error writing image: empty image\n");
+        return 1;
+    }
+    int row_bytes = (width + 7) / 8;
+    uint8_t last_mask = width % 8 ? 0xFF << (8 - width % 8) : 0xFF;
+    char header[128];
+
+    if (format == OF_PBM) {
+        int length = snprintf(header, sizeof(header), "P4\n%d %d\n", width, height);
+        out.resize(length + (size_t) row_bytes * height);
+        memcpy(out.data(), header, length);
+        uint8_t* dst = out.data() + length;
+        for (int y = 0; y < height; y++, dst += row_bytes) raster_monoRow(pixels, stride, width, y, mono, dst);
+        return 0;
+    }
+
+    if (format == OF_ZPL) {
+        // A row equal to the one above is written as ':'
+        std::string text;
+        int length = snprintf(header, sizeof(header), "^XA\n^PW%d\n^LL%d\n^FO0,0^GFA,%d,%d,%d,", width, height, row_bytes * height, row_bytes * height, row_bytes);
+        text.append(header, length);
+        std::vector<uint8_t> line(row_bytes);
+        std::vector<uint8_t> previous(row_bytes);
+        for (int y = 0; y < height; y++) {
+            raster_monoRow(pixels, stride, width, y, mono, line.data());
+            if (y > 0 && line == previous) text.push_back(':');
+            else raster_gfRow(line.data(), row_bytes, text);
+            line.swap(previous);
+        }
+        text += "^FS\n^XZ\n";
+        out.assign(text.begin(), text.end());
+        return 0;
+    }
+
+    if (format == OF_PGM) {
+        int length = snprintf(header, sizeof(header), "P5\n%d %d\n255\n", width, height);
+        out.resize(length + (size_t) width * height);
+        memcpy(out.data(), header, length);
+        uint8_t* dst = out.data() + length;
+        for (int y = 0; y < height; y++, dst += width) {
+            const uint8_t* row = pixels + (size_t) y * stride;
+            if (mono) {
+                for (int x = 0; x < width; x++) dst[x] = (row[x >> 3] & (0x80 >> (x & 7))) ? 0 : 255;
+            } else {
+                for (int x = 0; x < width; x++) dst[x] = raster_gray(row + x * 4);
+            }
+        }
+        return 0;
+    }
+
+    if (format == OF_BMP) {
+        // Rows are stored bottom up and padded to 4 bytes. Monochrome rows are kept as they are with
+        // palette entry 0 white and 1 black
+        int bits = mono ? 1 : 24;
+        int palette = mono ? 2 * 4 : 0;
+        int line = mono ? (row_bytes + 3) & ~3 : (width * 3 + 3) & ~3;
+        uint32_t offset = 14 + 40 + palette;
+        uint32_t size = offset + (uint32_t) line * height;
+        out.assign(size, 0);
+        uint8_t* h = out.data();
+        h[0] = 'B';
+        h[1] = 'M';
+        raster_put32le(h + 2, size);
+        raster_put32le(h + 10, offset);
+        raster_put32le(h + 14, 40); // BITMAPINFOHEADER
+        raster_put32le(h + 18, width);
+        raster_put32le(h + 22, height);
+        raster_put16le(h + 26, 1); // Planes
+        raster_put16le(h + 28, bits);
+        raster_put32le(h + 34, (uint32_t) line * height);
+        if (mono) {
+            raster_put32le(h + 46, 2); // Colors used
+            memset(h + 54, 0xFF, 3); // Entry 0 is white, entry 1 stays black
+        }
+        for (int y = 0; y < height; y++) {
+            const uint8_t* row = pixels + (size_t) y * stride;
+            uint8_t* dst = out.data() + offset + (size_t) line * (height - 1 - y);
+            if (mono) {
+                memcpy(dst, row, row_bytes);
+                dst[row_bytes - 1] &= last_mask;
+                continue;
+            }
+            for (int x = 0; x < width; x++) {
+                dst[x * 3 + 0] = row[x * 4 + 2];
+                dst[x * 3 + 1] = row[x * 4 + 1];
+                dst[x * 3 + 2] = row[x * 4 + 0];
+            }
+        }
+        return 0;
+    }
+
+    notifyf("Unknown output format %d\n", format);
+    return 1;
+}
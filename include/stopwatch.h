@@ -100,4 +100,4 @@ struct StopWatch {
         printf("Failed to get time: Timer \"%s\" not found\n", name);
         return 0;
     }
-} timer;
\ No newline at end of file
+};
\ No newline at end of file
@@ -121,19 +121,27 @@ public:
 
     // Find the first occurrence of a character
     size_t find(char c) const {
-        for (size_t i = 0; i < length_; i++) {
-            if (str_[offset_ + i] == c) return i;
-        }
-        return length_;
+        if (length_ == 0) return length_;
+        const char* at = (const char*) memchr(str_ + offset_, c, length_);
+        return at ? at - (str_ + offset_) : length_;
     }
 
     int indexOf(char c) const {
-        for (size_t i = 0; i < length_; i++) {
-            if (str_[offset_ + i] == c) return i;
-        }
-        return -1;
+        size_t i = find(c);
+        return i < length_ ? (int) i : -1;
     }
 
+    // Shift up to the first occurrence of a character, or to the end. Returns the number of characters skipped
+    size_t skipTo(char c) {
+        size_t i = find(c);
+        offset_ += i;
+        length_ -= i;
+        return i;
+    }
+
+    // Pointer to the current start, not null terminated
+    const char* data() const { return str_ + offset_; }
+
     // Match the start of the string with a given prefix
     bool startsWith(const char* prefix) const {
         size_t len = strlen(prefix);
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Worker threads that run batches of indexed jobs. The calling thread takes part in every batch and
+// run() only returns once all jobs of the batch are done, so jobs may reference the caller's stack.
+// A batch started from inside a job runs on that thread alone, the pool is already busy with the outer batch.
+// So does a batch of one job, and a batch started while another thread has the workers, rather than waiting for them
+class ThreadPool {
+private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    std::mutex batch_mutex; // One batch at a time
+    std::once_flag started;
+    const std::function<void(int)>* job = nullptr;
+    int count = 0;
+    std::atomic<int> next { 0 };
+    int active = 0; // Workers still inside the current batch
+    uint64_t generation = 0;
+    bool stopping = false;
+
+    // Set while the thread runs a job of a batch
+    static bool& insideJob() {
+        static thread_local bool inside = false;
+        return inside;
+    }
+
+    void work(int limit) {
+        insideJob() = true;
+        while (true) {
+            int i = next.fetch_add(1);
+            if (i >= limit) break;
+            (*job)(i);
+        }
+        insideJob() = false;
+    }
+
+    void loop() {
+        uint64_t seen = 0;
+        while (true) {
+            int limit;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+                limit = count;
+            }
+            work(limit);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--active == 0) finished.notify_one();
+        }
+    }
+
+    // Run the batch on the calling thread alone
+    void runInline(int count, const std::function<void(int)>& job) {
+        bool inside = insideJob();
+        insideJob() = true;
+        for (int i = 0; i < count; i++) job(i);
+        insideJob() = inside;
+    }
+
+    void start() {
+        int threads = std::thread::hardware_concurrency();
+        if (threads < 1) threads = 1;
+        for (int i = 1; i < threads; i++) workers.emplace_back(&ThreadPool::loop, this);
+    }
+
+public:
+    ThreadPool() {}
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers) worker.join();
+    }
+
+    // Number of threads that work on a batch, including the caller
+    int size() {
+        if (insideJob()) return 1;
+        std::call_once(started, [this] { start(); });
+        return workers.size() + 1;
+    }
+
+    // Run job(0) .. job(count - 1) spread over the workers and the calling thread
+    void run(int count, const std::function<void(int)>& job) {
+        if (count <= 0) return;
+        if (insideJob()) {
+            for (int i = 0; i < count; i++) job(i);
+            return;
+        }
+        std::call_once(started, [this] { start(); });
+        if (count == 1 || workers.empty()) {
+            runInline(count, job);
+            return;
+        }
+        std::unique_lock<std::mutex> batch(batch_mutex, std::try_to_lock);
+        if (!batch.owns_lock()) {
+            runInline(count, job);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            this->job = &job;
+            this->count = count;
+            next = 0;
+            active = workers.size();
+            generation++;
+        }
+        wake.notify_all();
+        work(count);
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [&] { return active == 0; });
+        this->job = nullptr;
+    }
+};
+
+ThreadPool thread_pool;
@@ -0,0 +1,262 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <functional>
+#include <vector>
+
+#include "tools.h"
+
+#define TIFF_DEFAULT_DPI 203 // Zebra printers print at 8 dots per mm
+
+// CCITT T.4 run length codes, MSB first
+struct TiffCode {
+    uint16_t code;
+    uint8_t length;
+};
+
+static const TiffCode tiff_white_terminating[64] = {
+    { 0x035, 8 }, { 0x007, 6 }, { 0x007, 4 }, { 0x008, 4 }, { 0x00B, 4 }, { 0x00C, 4 }, { 0x00E, 4 }, { 0x00F, 4 },
+    { 0x013, 5 }, { 0x014, 5 }, { 0x007, 5 }, { 0x008, 5 }, { 0x008, 6 }, { 0x003, 6 }, { 0x034, 6 }, { 0x035, 6 },
+    { 0x02A, 6 }, { 0x02B, 6 }, { 0x027, 7 }, { 0x00C, 7 }, { 0x008, 7 }, { 0x017, 7 }, { 0x003, 7 }, { 0x004, 7 },
+    { 0x028, 7 }, { 0x02B, 7 }, { 0x013, 7 }, { 0x024, 7 }, { 0x018, 7 }, { 0x002, 8 }, { 0x003, 8 }, { 0x01A, 8 },
+    { 0x01B, 8 }, { 0x012, 8 }, { 0x013, 8 }, { 0x014, 8 }, { 0x015, 8 }, { 0x016, 8 }, { 0x017, 8 }, { 0x028, 8 },
+    { 0x029, 8 }, { 0x02A, 8 }, { 0x02B, 8 }, { 0x02C, 8 }, { 0x02D, 8 }, { 0x004, 8 }, { 0x005, 8 }, { 0x00A, 8 },
+    { 0x00B, 8 }, { 0x052, 8 }, { 0x053, 8 }, { 0x054, 8 }, { 0x055, 8 }, { 0x024, 8 }, { 0x025, 8 }, { 0x058, 8 },
+    { 0x059, 8 }, { 0x05A, 8 }, { 0x05B, 8 }, { 0x04A, 8 }, { 0x04B, 8 }, { 0x032, 8 }, { 0x033, 8 }, { 0x034, 8 },
+};
+static const TiffCode tiff_white_makeup[27] = {
+    { 0x01B, 5 }, { 0x012, 5 }, { 0x017, 6 }, { 0x037, 7 }, { 0x036, 8 }, { 0x037, 8 }, { 0x064, 8 }, { 0x065, 8 },
+    { 0x068, 8 }, { 0x067, 8 }, { 0x0CC, 9 }, { 0x0CD, 9 }, { 0x0D2, 9 }, { 0x0D3, 9 }, { 0x0D4, 9 }, { 0x0D5, 9 },
+    { 0x0D6, 9 }, { 0x0D7, 9 }, { 0x0D8, 9 }, { 0x0D9, 9 }, { 0x0DA, 9 }, { 0x0DB, 9 }, { 0x098, 9 }, { 0x099, 9 },
+    { 0x09A, 9 }, { 0x018, 6 }, { 0x09B, 9 },
+};
+static const TiffCode tiff_black_terminating[64] = {
+    { 0x037, 10 }, { 0x002, 3 }, { 0x003, 2 }, { 0x002, 2 }, { 0x003, 3 }, { 0x003, 4 }, { 0x002, 4 }, { 0x003, 5 },
+    { 0x005, 6 }, { 0x004, 6 }, { 0x004, 7 }, { 0x005, 7 }, { 0x007, 7 }, { 0x004, 8 }, { 0x007, 8 }, { 0x018, 9 },
+    { 0x017, 10 }, { 0x018, 10 }, { 0x008, 10 }, { 0x067, 11 }, { 0x068, 11 }, { 0x06C, 11 }, { 0x037, 11 },
+    { 0x028, 11 }, { 0x017, 11 }, { 0x018, 11 }, { 0x0CA, 12 }, { 0x0CB, 12 }, { 0x0CC, 12 }, { 0x0CD, 12 },
+    { 0x068, 12 }, { 0x069, 12 }, { 0x06A, 12 }, { 0x06B, 12 }, { 0x0D2, 12 }, { 0x0D3, 12 }, { 0x0D4, 12 },
+    { 0x0D5, 12 }, { 0x0D6, 12 }, { 0x0D7, 12 }, { 0x06C, 12 }, { 0x06D, 12 }, { 0x0DA, 12 }, { 0x0DB, 12 },
+    { 0x054, 12 }, { 0x055, 12 }, { 0x056, 12 }, { 0x057, 12 }, { 0x064, 12 }, { 0x065, 12 }, { 0x052, 12 },
+    { 0x053, 12 }, { 0x024, 12 }, { 0x037, 12 }, { 0x038, 12 }, { 0x027, 12 }, { 0x028, 12 }, { 0x058, 12 },
+    { 0x059, 12 }, { 0x02B, 12 }, { 0x02C, 12 }, { 0x05A, 12 }, { 0x066, 12 }, { 0x067, 12 },
+};
+static const TiffCode tiff_black_makeup[27] = {
+    { 0x00F, 10 }, { 0x0C8, 12 }, { 0x0C9, 12 }, { 0x05B, 12 }, { 0x033, 12 }, { 0x034, 12 }, { 0x035, 12 },
+    { 0x06C, 13 }, { 0x06D, 13 }, { 0x04A, 13 }, { 0x04B, 13 }, { 0x04C, 13 }, { 0x04D, 13 }, { 0x072, 13 },
+    { 0x073, 13 }, { 0x074, 13 }, { 0x075, 13 }, { 0x076, 13 }, { 0x077, 13 }, { 0x052, 13 }, { 0x053, 13 },
+    { 0x054, 13 }, { 0x055, 13 }, { 0x05A, 13 }, { 0x05B, 13 }, { 0x064, 13 }, { 0x065, 13 },
+};
+static const TiffCode tiff_extended_makeup[13] = {
+    { 0x008, 11 }, { 0x00C, 11 }, { 0x00D, 11 }, { 0x012, 12 }, { 0x013, 12 }, { 0x014, 12 }, { 0x015, 12 },
+    { 0x016, 12 }, { 0x017, 12 }, { 0x01C, 12 }, { 0x01D, 12 }, { 0x01E, 12 }, { 0x01F, 12 },
+};
+
+// Writes codes MSB first, the fill order TIFF readers assume by default
+struct TiffBitWriter {
+    std::vector<unsigned char>& out;
+    uint32_t bits = 0;
+    int count = 0;
+
+    TiffBitWriter(std::vector<unsigned char>& out) : out(out) {}
+
+    void put(uint32_t code, int length) {
+        bits = (bits << length) | code;
+        count += length;
+        while (count >= 8) {
+            count -= 8;
+            out.push_back((unsigned char) (bits >> count));
+        }
+    }
+
+    void put(const TiffCode& code) {
+        put(code.code, code.length);
+    }
+
+    // A run of one color: makeup codes for every 64 pixels, then the terminating code for the rest
+    void run(int length, bool black) {
+        while (length >= 2624) {
+            put(tiff_extended_makeup[12]); // 2560
+            length -= 2560;
+        }
+        if (length >= 64) {
+            int makeup = length / 64;
+            if (makeup > 27) put(tiff_extended_makeup[makeup - 28]);
+            else put(black ? tiff_black_makeup[makeup - 1] : tiff_white_makeup[makeup - 1]);
+            length -= makeup * 64;
+        }
+        put(black ? tiff_black_terminating[length] : tiff_white_terminating[length]);
+    }
+
+    void flush() {
+        if (count > 0) out.push_back((unsigned char) (bits << (8 - count)));
+        count = 0;
+    }
+};
+
+// Changing elements of a packed row (MSB first, 1 = black): the positions where the color differs from the pixel before,
+// starting from white. Whole bytes of the current color are skipped. Ends with width twice, so lookups past the last
+// change land on the end of the row
+void tiff_changes(const uint8_t* row, int width, std::vector<int>& changes) {
+    changes.clear();
+    int row_bytes = (width + 7) / 8;
+    int color = 0;
+    for (int i = 0; i < row_bytes; i++) {
+        uint8_t byte = row[i];
+        if (byte == (color ? 0xFF : 0x00)) continue;
+        for (int bit = 0; bit < 8; bit++) {
+            int x = i * 8 + bit;
+            if (x >= width) break;
+            if (((byte >> (7 - bit)) & 1) != color) {
+                changes.push_back(x);
+                color ^= 1;
+            }
+        }
+    }
+    changes.push_back(width);
+    changes.push_back(width);
+}
+
+// Code one row in T.6 two dimensional mode against the changing elements of the row above
+void tiff_codeRow(TiffBitWriter& writer, const std::vector<int>& line, const std::vector<int>& reference, int width) {
+    int a0 = -1; // Imaginary white pixel before the row
+    int color = 0; // Color of a0
+    size_t i = 0; // First change on the coding line right of a0
+    size_t j = 0; // First change on the reference line right of a0, of either color
+    while (a0 < width) {
+        while (line[i] <= a0) i++;
+        int a1 = line[i];
+        // b1 is the first change right of a0 to the opposite color of a0, even changes turn black.
+        // The skipped change can be b1 again once the color flips, so only j is kept
+        while (reference[j] <= a0) j++;
+        size_t k = std::min(j + ((j & 1) != (size_t) color), reference.size() - 1);
+        int b1 = reference[k];
+        int b2 = reference[std::min(k + 1, reference.size() - 1)];
+        if (b2 < a1) {
+            writer.put(0x1, 4); // Pass
+            a0 = b2;
+            continue;
+        }
+        int d = a1 - b1;
+        if (d >= -3 && d <= 3) {
+            static const TiffCode vertical[7] = { { 0x02, 7 }, { 0x02, 6 }, { 0x2, 3 }, { 0x1, 1 }, { 0x3, 3 }, { 0x03, 6 }, { 0x03, 7 } };
+            writer.put(vertical[d + 3]);
+            a0 = a1;
+            color ^= 1;
+            continue;
+        }
+        int a2 = line[std::min(i + 1, line.size() - 1)];
+        writer.put(0x1, 3); // Horizontal
+        writer.run(a1 - std::max(a0, 0), color);
+        writer.run(a2 - a1, !color);
+        a0 = a2;
+    }
+}
+
+void tiff_put16(std::vector<unsigned char>& out, size_t at, uint32_t value) {
+    out[at + 0] = value & 0xFF;
+    out[at + 1] = (value >> 8) & 0xFF;
+}
+
+void tiff_put32(std::vector<unsigned char>& out, size_t at, uint32_t value) {
+    tiff_put16(out, at, value & 0xFFFF);
+    tiff_put16(out, at + 2, value >> 16);
+}
+
+// Write a width x height single strip CCITT Group 4 TIFF into out (replacing its contents), row_changes fills in the
+// changing elements of row y the way tiff_changes does. Returns 0 on success
+int tiff_encode(int width, int height, int dpi, std::vector<unsigned char>& out, const std::function<void(int y, std::vector<int>& line)>& row_changes) {
+    out.clear();
+    if (width <= 0 || height <= 0) {
+        notifyf("Error writing TIFF: empty image\n");
+        return 1;
+    }
+    if (dpi <= 0) dpi = TIFF_DEFAULT_DPI;
+    out.resize(8); // Header, the strip follows it
+    TiffBitWriter writer(out);
+    std::vector<int> line;
+    std::vector<int> reference = { width, width }; // Imaginary white row above the first
+    for (int y = 0; y < height; y++) {
+        row_changes(y, line);
+        tiff_codeRow(writer, line, reference, width);
+        line.swap(reference);
+    }
+    writer.put(0x001, 12); // End of facsimile block
+    writer.put(0x001, 12);
+    writer.flush();
+    uint32_t strip_size = out.size() - 8;
+    if (out.size() & 1) out.push_back(0); // The IFD starts on a word boundary
+
+    struct Entry {
+        uint16_t tag;
+        uint16_t type; // 3 = SHORT, 4 = LONG, 5 = RATIONAL
+        uint32_t value;
+    };
+    const int entry_count = 14;
+    uint32_t ifd = out.size();
+    uint32_t resolution = ifd + 2 + entry_count * 12 + 4; // Two RATIONALs after the IFD
+    const Entry entries[entry_count] = {
+        { 256, 4, (uint32_t) width }, // ImageWidth
+        { 257, 4, (uint32_t) height }, // ImageLength
+        { 258, 3, 1 }, // BitsPerSample
+        { 259, 3, 4 }, // Compression: CCITT T.6
+        { 262, 3, 0 }, // PhotometricInterpretation: WhiteIsZero
+        { 266, 3, 1 }, // FillOrder: MSB first
+        { 273, 4, 8 }, // StripOffsets
+        { 277, 3, 1 }, // SamplesPerPixel
+        { 278, 4, (uint32_t) height }, // RowsPerStrip
+        { 279, 4, strip_size }, // StripByteCounts
+        { 282, 5, resolution }, // XResolution
+        { 283, 5, resolution + 8 }, // YResolution
+        { 293, 4, 0 }, // T6Options
+        { 296, 3, 2 }, // ResolutionUnit: inch
+    };
+    out.resize(resolution + 16);
+    tiff_put16(out, ifd, entry_count);
+    for (int e = 0; e < entry_count; e++) {
+        size_t at = ifd + 2 + e * 12;
+        tiff_put16(out, at, entries[e].tag);
+        tiff_put16(out, at + 2, entries[e].type);
+        tiff_put32(out, at + 4, 1); // Count
+        if (entries[e].type == 3) tiff_put16(out, at + 8, entries[e].value);
+        else tiff_put32(out, at + 8, entries[e].value);
+    }
+    tiff_put32(out, ifd + 2 + entry_count * 12, 0); // No further IFD
+    for (int r = 0; r < 2; r++) {
+        tiff_put32(out, resolution + r * 8, dpi);
+        tiff_put32(out, resolution + r * 8 + 4, 1);
+    }
+    out[0] = 'I';
+    out[1] = 'I';
+    tiff_put16(out, 2, 42);
+    tiff_put32(out, 4, ifd);
+    return 0;
+}
+
+// Write width x height pixels as a Group 4 TIFF. Monochrome pixels are packed 1 bpp rows, MSB first with 1 = black,
+// otherwise 4 bytes per pixel RGBA and pixels darker than mid gray are black. Returns 0 on success
+int encodeTiffG4(const uint8_t* pixels, int stride, int width, int height, bool mono, int dpi, std::vector<unsigned char>& out) {
+    std::vector<uint8_t> threshold((width + 7) / 8);
+    return tiff_encode(width, height, dpi, out, [&](int y, std::vector<int>& line) {
+        const uint8_t* row = pixels + (size_t) y * stride;
+        if (!mono) {
+            memset(threshold.data(), 0, threshold.size());
+            for (int x = 0; x < width; x++) {
+                const uint8_t* pixel = row + x * 4;
+                if (pixel[0] * 77 + pixel[1] * 150 + pixel[2] * 29 < 128 * 256) threshold[x >> 3] |= 0x80 >> (x & 7);
+            }
+            row = threshold.data();
+        }
+        tiff_changes(row, width, line);
+    });
+}
+
+// Write a run length image as a Group 4 TIFF. Its rows already are changing elements, so they are coded as they are
+int encodeTiffG4Runs(const std::vector<std::vector<int>>& runs, int width, int height, int dpi, std::vector<unsigned char>& out) {
+    return tiff_encode(width, height, dpi, out, [&](int y, std::vector<int>& line) {
+        line.assign(runs[y].begin(), runs[y].end());
+        line.push_back(width);
+        line.push_back(width);
+    });
+}
@@ -0,0 +1,335 @@
+#pragma once
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "tools.h"
+#include "lodepng.h"
+#include "rasterx.h"
+#include "pdfx.h"
+
+#define PDF_KAPPA 0.5522847498 // Bezier control distance for a quarter circle of radius 1
+
+// Writes a label as SVG, EPS or a PDF page instead of rasterizing it. Coordinates are in dots with y pointing down like the raster,
+// EPS and PDF output is scaled to points from the label dpi.
+// ^FR fields are drawn white with a difference blend in SVG and PDF, which inverts what is below them like the raster does.
+// PostScript has no such mode, so EPS draws them white, which is right for the usual reversed field over black ink
+class VectorWriter {
+public:
+    VectorWriter(OUTPUT_FORMAT format, std::vector<unsigned char>& out, int dpi = 0) : format(format), out(out) {
+        this->dpi = dpi > 0 ? dpi : TIFF_DEFAULT_DPI;
+    }
+
+    // Writes the content stream of a page into out, fonts and bitmaps go into the document
+    VectorWriter(PdfDocument& pdf, std::vector<unsigned char>& out, int dpi = 0) : format(OF_PDF), out(out), pdf(&pdf) {
+        this->dpi = dpi > 0 ? dpi : TIFF_DEFAULT_DPI;
+    }
+
+    int width = 0; // Size in dots given to begin
+    int height = 0;
+
+    void begin(int width, int height) {
+        this->width = width;
+        this->height = height;
+        out.clear();
+        if (format == OF_SVG) {
+            print("<?xml version=\"1.0\" standalone=\"no\"?>\n");
+            print("<svg xmlns=\"http://www.w3.org/2000/svg\" xmlns:xlink=\"http://www.w3.org/1999/xlink\" version=\"1.1\" width=\"%d\" height=\"%d\" viewBox=\"0 0 %d %d\" style=\"isolation:isolate\">\n", width, height, width, height);
+            print("<rect width=\"%d\" height=\"%d\" fill=\"#fff\"/>\n", width, height);
+            return;
+        }
+        double scale = 72.0 / dpi;
+        if (format == OF_PDF) {
+            // The page is painted white first so a difference blend has a backdrop to invert
+            print("%g 0 0 %g 0 %g cm\n", scale, -scale, height * scale);
+            print("1 g 0 0 %d %d re f 0 g\n", width, height);
+            return;
+        }
+        print("%%!PS-Adobe-3.0 EPSF-3.0\n");
+        print("%%%%BoundingBox: 0 0 %d %d\n", (int) ceil(width * scale), (int) ceil(height * scale));
+        print("%%%%HiResBoundingBox: 0 0 %g %g\n", width * scale, height * scale);
+        print("%%%%Creator: zpl2png\n");
+        print("%%%%EndComments\n");
+        print("gsave\n%g %g scale 0 %d translate 1 -1 scale\n", scale, scale, height);
+        print("1 setgray 0 0 %d %d rectfill 0 setgray\n", width, height);
+    }
+
+    void end() {
+        if (format == OF_SVG) print("</svg>\n");
+        else if (format == OF_EPS) print("grestore\nshowpage\n%%%%EOF\n");
+    }
+
+    // Rectangle with corners rounded by radius, filled when stroke is 0, otherwise a border of that width inside it
+    void rect(double x, double y, double w, double h, double radius, double stroke, bool white, bool inverted) {
+        if (w <= 0 || h <= 0) return;
+        if (stroke > 0) {
+            // The path runs through the middle of the border
+            x += stroke / 2;
+            y += stroke / 2;
+            w -= stroke;
+            h -= stroke;
+            radius = std::max(0.0, radius - stroke / 2);
+        }
+        if (format == OF_SVG) {
+            print("<rect x=\"%g\" y=\"%g\" width=\"%g\" height=\"%g\"", x, y, w, h);
+            if (radius > 0) print(" rx=\"%g\"", radius);
+            paint(stroke, white, inverted);
+            return;
+        }
+        if (format == OF_PDF) {
+            pdfInk(white, inverted);
+            if (radius <= 0) {
+                print("%g %g %g %g re", x, y, w, h);
+            } else {
+                double k = radius * PDF_KAPPA;
+                print("%g %g m %g %g l %g %g %g %g %g %g c ", x + radius, y, x + w - radius, y, x + w - radius + k, y, x + w, y + radius - k, x + w, y + radius);
+                print("%g %g l %g %g %g %g %g %g c ", x + w, y + h - radius, x + w, y + h - radius + k, x + w - radius + k, y + h, x + w - radius, y + h);
+                print("%g %g l %g %g %g %g %g %g c ", x + radius, y + h, x + radius - k, y + h, x, y + h - radius + k, x, y + h - radius);
+                print("%g %g l %g %g %g %g %g %g c h", x, y + radius, x, y + radius - k, x + radius - k, y, x + radius, y);
+            }
+            pdfPaint(stroke, white, inverted);
+            return;
+        }
+        if (white || inverted) print("1 setgray\n");
+        if (radius <= 0 && stroke <= 0) {
+            print("%g %g %g %g rectfill\n", x, y, w, h);
+        } else if (radius <= 0) {
+            print("%g setlinewidth %g %g %g %g rectstroke\n", stroke, x, y, w, h);
+        } else {
+            print("newpath %g %g moveto %g %g %g %g %g arct %g %g %g %g %g arct %g %g %g %g %g arct %g %g %g %g %g arct closepath ",
+                x + radius, y, x + w, y, x + w, y + h, radius, x + w, y + h, x, y + h, radius, x, y + h, x, y, radius, x, y, x + w, y, radius);
+            finish(stroke);
+        }
+        if (white || inverted) print("0 setgray\n");
+    }
+
+    // Ellipse around (cx, cy), filled when stroke is 0, otherwise a border of that width inside it
+    void ellipse(double cx, double cy, double rx, double ry, double stroke, bool white, bool inverted) {
+        if (rx <= 0 || ry <= 0) return;
+        if (stroke > 0) {
+            rx -= stroke / 2;
+            ry -= stroke / 2;
+        }
+        if (format == OF_SVG) {
+            print("<ellipse cx=\"%g\" cy=\"%g\" rx=\"%g\" ry=\"%g\"", cx, cy, rx, ry);
+            paint(stroke, white, inverted);
+            return;
+        }
+        if (format == OF_PDF) {
+            // Four Bezier quarters
+            double kx = rx * PDF_KAPPA;
+            double ky = ry * PDF_KAPPA;
+            pdfInk(white, inverted);
+            print("%g %g m %g %g %g %g %g %g c ", cx + rx, cy, cx + rx, cy + ky, cx + kx, cy + ry, cx, cy + ry);
+            print("%g %g %g %g %g %g c ", cx - kx, cy + ry, cx - rx, cy + ky, cx - rx, cy);
+            print("%g %g %g %g %g %g c ", cx - rx, cy - ky, cx - kx, cy - ry, cx, cy - ry);
+            print("%g %g %g %g %g %g c h", cx + kx, cy - ry, cx + rx, cy - ky, cx + rx, cy);
+            pdfPaint(stroke, white, inverted);
+            return;
+        }
+        if (white || inverted) print("1 setgray\n");
+        // The path is scaled, the stroke is drawn after restoring the matrix so its width stays even
+        print("newpath matrix currentmatrix %g %g translate %g %g scale 0 0 1 0 360 arc setmatrix ", cx, cy, rx, ry);
+        finish(stroke);
+        if (white || inverted) print("0 setgray\n");
+    }
+
+    // Filled polygon through count points given as x, y pairs
+    void polygon(const double* points, int count, bool white, bool inverted) {
+        if (count < 3) return;
+        if (format == OF_SVG) {
+            print("<polygon points=\"");
+            for (int i = 0; i < count; i++) print(i ? " %g,%g" : "%g,%g", points[i * 2], points[i * 2 + 1]);
+            print("\"");
+            paint(0, white, inverted);
+            return;
+        }
+        if (format == OF_PDF) {
+            pdfInk(white, inverted);
+            print("%g %g m", points[0], points[1]);
+            for (int i = 1; i < count; i++) print(" %g %g l", points[i * 2], points[i * 2 + 1]);
+            print(" h");
+            pdfPaint(0, white, inverted);
+            return;
+        }
+        if (white || inverted) print("1 setgray\n");
+        print("newpath %g %g moveto", points[0], points[1]);
+        for (int i = 1; i < count; i++) print(" %g %g lineto", points[i * 2], points[i * 2 + 1]);
+        print(" closepath fill\n");
+        if (white || inverted) print("0 setgray\n");
+    }
+
+    // Text with its top at y, placed like Image::drawText which puts the baseline 2/3 of the size down
+    void text(double x, double y, double size, const char* str, const char* font, bool white, bool inverted) {
+        if (size <= 0 || !str || !str[0]) return;
+        double baseline = y + (int) size * 2 / 3;
+        if (format == OF_SVG) {
+            print("<text x=\"%g\" y=\"%g\" font-size=\"%g\" font-family=\"%s\"", x, baseline, size, svgFont(font));
+            print(inverted ? " fill=\"#fff\" style=\"mix-blend-mode:difference\">" : white ? " fill=\"#fff\">" : " fill=\"#000\">");
+            for (const char* c = str; *c; c++) {
+                if (*c == '<') print("&lt;");
+                else if (*c == '>') print("&gt;");
+                else if (*c == '&') print("&amp;");
+                else if (*c == '"') print("&quot;");
+                else out.push_back(*c);
+            }
+            print("</text>\n");
+            return;
+        }
+        if (format == OF_PDF) {
+            // The text matrix flips the glyphs back upright
+            pdfInk(white, inverted);
+            print("BT /F%d %g Tf 1 0 0 -1 %g %g Tm (", pdf->font(epsFont(font)), size, x, baseline);
+            escape(str);
+            print(") Tj ET\n");
+            if (white || inverted) print("Q\n");
+            return;
+        }
+        if (white || inverted) print("1 setgray\n");
+        print("gsave /%s findfont %g scalefont setfont %g %g moveto 1 -1 scale (", epsFont(font), size, x, baseline);
+        escape(str);
+        print(") show grestore\n");
+        if (white || inverted) print("0 setgray\n");
+    }
+
+    // 1 bit image of width x height dots at (x, y), rows of row_bytes MSB first where 1 = black. Only the black dots are
+    // painted, like blitBitmap
+    void bitmap(double x, double y, const uint8_t* bits, int row_bytes, int width, int height, bool inverted) {
+        if (width <= 0 || height <= 0) return;
+        if (format == OF_SVG) {
+            // PNG with a two color palette: index 0 transparent, index 1 black (white for a difference blend)
+            lodepng::State state;
+            state.encoder.auto_convert = 0;
+            for (LodePNGColorMode* mode : { &state.info_raw, &state.info_png.color }) {
+                mode->colortype = LCT_PALETTE;
+                mode->bitdepth = 1;
+                lodepng_palette_add(mode, 255, 255, 255, 0);
+                uint8_t ink = inverted ? 255 : 0;
+                lodepng_palette_add(mode, ink, ink, ink, 255);
+            }
+            // lodepng expects rows without padding, which only ^GF widths that are a multiple of 8 have
+            std::vector<uint8_t> packed;
+            const uint8_t* pixels = bits;
+            if (row_bytes * 8 != width) {
+                packed.assign(((size_t) width * height + 7) / 8, 0);
+                for (int iy = 0; iy < height; iy++) {
+                    for (int ix = 0; ix < width; ix++) {
+                        size_t bit = (size_t) iy * width + ix;
+                        if (bits[iy * row_bytes + (ix >> 3)] & (0x80 >> (ix & 7))) packed[bit >> 3] |= 0x80 >> (bit & 7);
+                    }
+                }
+                pixels = packed.data();
+            }
+            std::vector<unsigned char> png;
+            if (lodepng::encode(png, pixels, width, height, state)) return;
+            std::string data = b64encode(png.data(), png.size());
+            print("<image x=\"%g\" y=\"%g\" width=\"%d\" height=\"%d\" image-rendering=\"pixelated\"", x, y, width, height);
+            if (inverted) print(" style=\"mix-blend-mode:difference\"");
+            print(" xlink:href=\"data:image/png;base64,");
+            out.insert(out.end(), data.begin(), data.end());
+            print("\"/>\n");
+            return;
+        }
+        if (format == OF_PDF) {
+            // PDF rows are padded to whole bytes only
+            int packed_bytes = (width + 7) / 8;
+            std::vector<uint8_t> packed;
+            const uint8_t* rows = bits;
+            if (row_bytes != packed_bytes) {
+                packed.resize((size_t) packed_bytes * height);
+                for (int iy = 0; iy < height; iy++) memcpy(packed.data() + (size_t) iy * packed_bytes, bits + (size_t) iy * row_bytes, packed_bytes);
+                rows = packed.data();
+            }
+            int number = pdf->image(rows, width, height);
+            if (!number) return;
+            pdfInk(false, inverted);
+            print("q %d 0 0 %d %g %g cm /Im%d Do Q\n", width, -height, x, y + height, number);
+            if (inverted) print("Q\n");
+            return;
+        }
+        // imagemask paints the 1 bits in the current color, the image matrix maps the rows top down onto the unit square.
+        // The rows follow inline and are read one at a time, a single string would pass the 65535 byte limit
+        int packed_bytes = (width + 7) / 8;
+        print("gsave 1 dict begin /picstr %d string def %g %g translate %d %d scale\n", packed_bytes, x, y, width, height);
+        if (inverted) print("1 setgray\n");
+        print("%d %d true [%d 0 0 %d 0 0] {currentfile picstr readhexstring pop} imagemask\n", width, height, width, height);
+        static const char hex[] = "0123456789abcdef";
+        for (int iy = 0; iy < height; iy++) {
+            const uint8_t* row = bits + (size_t) iy * row_bytes;
+            for (int i = 0; i < packed_bytes; i++) {
+                out.push_back(hex[row[i] >> 4]);
+                out.push_back(hex[row[i] & 15]);
+            }
+            out.push_back('\n');
+        }
+        print("end grestore\n");
+    }
+
+private:
+    OUTPUT_FORMAT format;
+    std::vector<unsigned char>& out;
+    PdfDocument* pdf = nullptr;
+    int dpi;
+
+    void print(const char* format, ...) {
+        char buffer[512];
+        va_list args;
+        va_start(args, format);
+        int length = vsnprintf(buffer, sizeof(buffer), format, args);
+        va_end(args);
+        if (length > 0) out.insert(out.end(), buffer, buffer + std::min(length, (int) sizeof(buffer) - 1));
+    }
+
+    // Close an SVG shape with its fill or border
+    void paint(double stroke, bool white, bool inverted) {
+        const char* ink = white || inverted ? "#fff" : "#000";
+        if (stroke > 0) print(" fill=\"none\" stroke=\"%s\" stroke-width=\"%g\"", ink, stroke);
+        else print(" fill=\"%s\"", ink);
+        if (inverted) print(" style=\"mix-blend-mode:difference\"");
+        print("/>\n");
+    }
+
+    // Set the color of a PDF shape, white or a difference blend are kept in a saved graphics state
+    void pdfInk(bool white, bool inverted) {
+        if (inverted) print("q /GD gs 1 g 1 G\n");
+        else if (white) print("q 1 g 1 G\n");
+    }
+
+    // Fill or stroke the current PDF path and restore the color
+    void pdfPaint(double stroke, bool white, bool inverted) {
+        if (stroke > 0) print(" %g w S\n", stroke);
+        else print(" f\n");
+        if (white || inverted) print("Q\n");
+    }
+
+    // PostScript and PDF string literal, without the parentheses
+    void escape(const char* str) {
+        for (const char* c = str; *c; c++) {
+            if (*c == '(' || *c == ')' || *c == '\\') out.push_back('\\');
+            out.push_back(*c);
+        }
+    }
+
+    // Fill or stroke the current PostScript path
+    void finish(double stroke) {
+        if (stroke > 0) print("%g setlinewidth stroke\n", stroke);
+        else print("fill\n");
+    }
+
+    static const char* svgFont(const char* font) {
+        if (!font) return "sans-serif";
+        if (!strcmp(font, "OCR-A")) return "OCR A Std, OCR A Extended, monospace";
+        if (!strcmp(font, "OCR-B")) return "OCR B Std, OCR-B, monospace";
+        if (!strcmp(font, "Roboto-Regular")) return "Roboto, sans-serif";
+        return "Helvetica, Arial, sans-serif";
+    }
+
+    // Standard PostScript fonts only, the OCR fonts fall back to Courier
+    static const char* epsFont(const char* font) {
+        if (font && (!strcmp(font, "OCR-A") || !strcmp(font, "OCR-B"))) return "Courier";
+        return "Helvetica";
+    }
+};
@@ -1,15 +1,20 @@
 #pragma once
 
+#include "arena.h"
 #include "draw_utils.h"
 #include "barcodex.h"
 #include "imagex.h"
 #include "stopwatch.h"
+#include "thread_pool.h"
 
 
 
 
-constexpr int ZPL_MAX_ELEMENTS = 1024 * 2;
-constexpr int ZPL_MAX_STRING = 1024 * 2;
+constexpr int ZPL_MIN_BAND_HEIGHT = 64; // Labels are split into horizontal bands of at least this many rows when rendered in parallel
+constexpr int ZPL_STREAM_BAND_HEIGHT = 64; // Rows per band when a label is rendered straight into a PNG stream
+constexpr int ZPL_GRID_CELLS = 32; // The spatial index is at most this many cells wide and tall
+constexpr int ZPL_GRID_MIN_CELL = 64; // Smallest cell of the spatial index in dots
+
 
 /*
 ^XA
@@ -50,7 +55,7 @@ constexpr int ZPL_MAX_STRING = 1024 * 2;
 */
 
 
-enum ZPL_CMD {
+enum ZPL_CMD : uint8_t {
     UNKNOWN = 0,
     XA, // Start Label
     XZ, // End Label
@@ -75,6 +80,7 @@ enum ZPL_CMD {
     BC, // Barcode 128
     FX, // Comment
     GF, // Graphic Field
+    ZPL_CMD_COUNT // Number of commands
 };
 
 // Use macro to generate the enum strings to make it easier to print the enum
@@ -100,81 +106,129 @@ enum ZPL_CMD {
     "FS", \
     "BY", \
     "B3", \
+    "BC", \
     "FX", \
     "GF"
 
 const char* ZPL_CMD_NAMES [] = { ZPL_CMD_STRINGS };
+static_assert(sizeof(ZPL_CMD_NAMES) / sizeof(ZPL_CMD_NAMES[0]) == ZPL_CMD_COUNT, "ZPL_CMD_STRINGS must name every command");
 
+// Command for every pair of command letters, indexed by the two bytes packed into 16 bits. Built once from ZPL_CMD_NAMES,
+// so a new command only needs its enum value and its name
+struct ZPL_command_table {
+    uint8_t commands[1 << 16];
 
+    ZPL_command_table() {
+        memset(commands, UNKNOWN, sizeof(commands));
+        for (int i = UNKNOWN + 1; i < ZPL_CMD_COUNT; i++) commands[key(ZPL_CMD_NAMES[i])] = i;
+    }
+
+    static int key(const char* letters) {
+        return (uint8_t) letters[0] << 8 | (uint8_t) letters[1];
+    }
+
+    ZPL_CMD find(const char* letters) const {
+        return (ZPL_CMD) commands[key(letters)];
+    }
+} zpl_commands;
 
 
-Image* temp_img = nullptr;
 
 // class ZPL_label;
 // class ZPL_element;
 
+// Text of a field, zero terminated in the label arena
+struct ZPL_text {
+    const char* data;
+    int length;
+
+    static ZPL_text of(const StringView& view) {
+        ZPL_text text;
+        text.data = view.data();
+        text.length = (int) view.length();
+        return text;
+    }
+};
+
+// A small header shared by every command followed by the payload of its type, so a label is one compact array
+// the layout and render loops walk front to back. Only the payload member matching the type is valid
 struct ZPL_element {
-    StringView str;
-    int len = 0;
     ZPL_CMD type = UNKNOWN;
-    int index = -1;
-    char character = '\0';
-    int x = 0;
-    int y = 0;
-    int width = 0;
-    int height = 0;
-    int radius = 0; // 0 - 8 (0 = square corners, 8 = round corners)
-    int diameter = 0; // Used for circles
-    char direction = 'R'; // Used for diagonal lines (left and right)
-    int inset = 0;
     char color = 'B'; // B = Black, W = White
-    StringView text;
-    int font_type = 0;
-    int font_size = 0;
     bool inverted = false;
-    int increment = 1;
-    bool padding = false;
-    bool barcode = false;
-    bool show_text = false;
-    bool checksum = false;
-    int barcode_width = 2;
-    int barcode_height = 10;
-    int barcode_wn_ratio = 3;
-    char orientation = 'N';
-    char check = 'N';
-    char mode = 'N';
-    char interpretation = 'N';
-    char interpretation_above = 'N';
-    std::vector<uint8_t> bitmap;
-    bool use_halfbyte = false;
+    char character = '\0'; // ^CC and ^CD
+    int x = 0; // Copies for ^PQ
+    int y = 0;
+    // Label home the element is drawn with and the pixels [box_x0, box_x1) x [box_y0, box_y1) it can touch, set by ZPL_label::layout
+    int home_x = 0;
+    int home_y = 0;
+    int box_x0 = 0;
+    int box_y0 = 0;
+    int box_x1 = 0;
+    int box_y1 = 0;
+    union {
+        struct {
+            int width;
+            int height;
+            int inset;
+            int radius; // 0 - 8 (0 = square corners, 8 = round corners)
+            int diameter; // Used for circles
+            char direction; // Used for diagonal lines (left and right)
+        } shape; // GB, GC, GD, GE
+        struct {
+            ZPL_text text;
+            int font_type;
+            int font_size;
+        } field; // FD, CF without text
+        struct {
+            ZPL_text text;
+            int width;
+            int height;
+            int wn_ratio;
+            char orientation;
+            char check;
+            char mode;
+            char interpretation;
+            char interpretation_above;
+        } barcode; // B3, BC
+        struct {
+            uint8_t* bitmap; // Packed 1 bit per dot, MSB first, rows of width bytes, in the label arena
+            int width;
+            int height;
+        } graphic; // GF
+        struct {
+            ZPL_text text;
+            int increment;
+            bool padding;
+        } serial; // SN
+        struct {
+            ZPL_text text;
+        } comment; // FX
+    };
+
     void print() {
-        if (type == UNKNOWN) {
-            printf("        Unknown: %.*s\n", str.length(), str.c_str());
-            return;
-        }
         switch (type) {
             case XA: printf("        XA  Start Label\n"); break;
             case XZ: printf("        XZ  End Label\n"); break;
             case CC: printf("        CC  Change Caret: %c\n", character); break;
             case CD: printf("        CD  Change Delimiter: %c\n", character); break;
-            case CF: printf("        CF  Font: %d, %d\n", font_type, font_size); break;
+            case CF: printf("        CF  Font: %d, %d\n", field.font_type, field.font_size); break;
                 // case PW: printf("        PW  Print Width: %d\n", width); break;
                 // case LL: printf("        LL  Label Length: %d\n", height); break;
             case LH: printf("        LH  Label Home: %d, %d\n", x, y); break;
             case PQ: printf("        PQ  Print Quantity: %d\n", x); break;
-            case SN: printf("        SN  Serial Number: %s\n", text.c_str()); break;
+            case SN: printf("        SN  Serial Number: %.*s\n", (int) serial.text.length, serial.text.data); break;
             case FO: printf("        FO  Field Origin: %d, %d\n", x, y); break;
-            case FX: printf("        FX  Comment: %s\n", text.c_str()); break;
-            case FD: printf("        FD  Text %d,%d  %d,%d  %c: %s\n", font_type, font_size, x, y, color ? color : 'B', text.c_str()); break;
-            case GB: printf("        GB  Rect: %d, %d, %d, %d, %d, %c, %d\n", x, y, width, height, inset, color, radius); break;
-            case GC: printf("        GC  Circle: %d, %d, %d, %d, %c\n", x, y, diameter, inset, color); break;
-            case GD: printf("        GD  Diagonal Line: %d, %d, %d, %d, %c, %c\n", x, y, width, height, direction, color); break;
-            case GE: printf("        GE  Ellipse: %d, %d, %d, %d, %c\n", x, y, width, height, color); break;
+            case FX: printf("        FX  Comment: %.*s\n", (int) comment.text.length, comment.text.data); break;
+            case FD: printf("        FD  Text %d,%d  %d,%d  %c: %.*s\n", field.font_type, field.font_size, x, y, color ? color : 'B', (int) field.text.length, field.text.data); break;
+            case GB: printf("        GB  Rect: %d, %d, %d, %d, %d, %c, %d\n", x, y, shape.width, shape.height, shape.inset, color, shape.radius); break;
+            case GC: printf("        GC  Circle: %d, %d, %d, %d, %c\n", x, y, shape.diameter, shape.inset, color); break;
+            case GD: printf("        GD  Diagonal Line: %d, %d, %d, %d, %c, %c\n", x, y, shape.width, shape.height, shape.direction, color); break;
+            case GE: printf("        GE  Ellipse: %d, %d, %d, %d, %c\n", x, y, shape.width, shape.height, color); break;
             case FR: printf("        FR  Invert\n"); break;
             case FS: printf("        FS  End Field\n"); break;
-            case BY: printf("        BY  Barcode Field Default %d, %d, %d, %d, %c, %c, %c, %c\n", x, y, width, height, orientation, check, interpretation, interpretation_above); break;
-            case B3: printf("        B3  Barcode [%d,%d] Code 39 %c,%c,%d,%c,%c -> %s\n", x, y, orientation, check, barcode_height, interpretation, interpretation_above, text.c_str()); break;
-            case BC: printf("        BC  Barcode [%d,%d] Code 128 %c,%c,%d,%c,%c -> %s\n", x, y, orientation, check, barcode_height, interpretation, interpretation_above, text.c_str()); break;
+            case B3: printf("        B3  Barcode [%d,%d] Code 39 %c,%c,%d,%c,%c -> %.*s\n", x, y, barcode.orientation, barcode.check, barcode.height, barcode.interpretation, barcode.interpretation_above, (int) barcode.text.length, barcode.text.data); break;
+            case BC: printf("        BC  Barcode [%d,%d] Code 128 %c,%c,%d,%c,%c -> %.*s\n", x, y, barcode.orientation, barcode.check, barcode.height, barcode.interpretation, barcode.interpretation_above, (int) barcode.text.length, barcode.text.data); break;
             case GF: printf("        GF  Graphic Field\n"); break;
 
             default: printf("        Other: %d\n", type); break;
@@ -205,6 +259,74 @@ struct ZPL_element {
         // }
     }
 
+    const char* fontName() {
+        switch (field.font_type) {
+            case 0: return "Helvetica";
+            case 1: return "OCR-A";
+            case 2: return "OCR-B";
+            case 3: return "Roboto-Regular";
+            default: return nullptr;
+        }
+    }
+
+    // Compute the bounding box for the given label home, elements that draw nothing get an empty box
+    void layout(int offset_x, int offset_y) {
+        home_x = offset_x;
+        home_y = offset_y;
+        int ix = x + offset_x;
+        int iy = y + offset_y;
+        int x0 = ix, y0 = iy, x1 = ix, y1 = iy;
+        switch (type) {
+            case GB: {
+                x1 = ix + shape.width;
+                y1 = iy + shape.height;
+            } break;
+            case GC: {
+                x1 = ix + shape.diameter + 1;
+                y1 = iy + shape.diameter + 1;
+            } break;
+            case GD: {
+                x1 = ix + shape.width + shape.inset + 1;
+                y1 = iy + shape.height;
+            } break;
+            case GE: {
+                x1 = ix + shape.width + 1;
+                y1 = iy + shape.height + 1;
+            } break;
+            case GF: {
+                x1 = ix + graphic.width * 8;
+                y1 = iy + graphic.height;
+            } break;
+            case FD: {
+                const char* font = fontName();
+                const char* str = field.text.data;
+                if (!font || !Image::measureText(ix, iy, field.font_size, str, font, x0, y0, x1, y1)) x1 = x0;
+            } break;
+            case B3: {
+                const char* str = barcode.text.data;
+                if (!MeasureBarcode_Code39(str, ix, iy, barcode.height, barcode.width, barcode.interpretation == 'Y', barcode.check == 'Y', x0, y0, x1, y1)) x1 = x0;
+            } break;
+            case BC: {
+                const char* str = barcode.text.data;
+                if (!MeasureBarcode_Code128(str, ix, iy, barcode.height, barcode.width, barcode.interpretation != 'N', barcode.mode, x0, y0, x1, y1)) x1 = x0;
+            } break;
+            default: break; // Draws nothing
+        }
+        // Nothing is drawn left of or above the canvas
+        box_x0 = std::max(x0, 0);
+        box_y0 = std::max(y0, 0);
+        box_x1 = x1;
+        box_y1 = y1;
+    }
+
+    bool isVisible() {
+        return box_x0 < box_x1 && box_y0 < box_y1;
+    }
+
+    bool overlaps(int x0, int y0, int x1, int y1) {
+        return isVisible() && box_x0 < x1 && box_x1 > x0 && box_y0 < y1 && box_y1 > y0;
+    }
+
     void draw(Image* image, int& offset_x, int& offset_y) {
         if (!image) return;
         switch (type) {
@@ -214,31 +336,31 @@ struct ZPL_element {
             } break;
 
             case GB: {
-                float roundness = (float) (radius < 0 ? 0 : radius > 8 ? 8 : radius) / 8.0f;
-                float shortHalf = width < height ? width / 2 : height / 2;
-                bool full = inset >= shortHalf;
+                float roundness = (float) (shape.radius < 0 ? 0 : shape.radius > 8 ? 8 : shape.radius) / 8.0f;
+                float shortHalf = shape.width < shape.height ? shape.width / 2 : shape.height / 2;
+                bool full = shape.inset >= shortHalf;
                 const Color stroke = color == 'W' ? WHITE : BLACK;
                 float ix = x + offset_x;
                 float iy = y + offset_y;
-                float iw = width;
-                float ih = height;
+                float iw = shape.width;
+                float ih = shape.height;
                 if (full) {
                     image->drawRoundedRectangle(ix, iy, iw, ih, roundness, 0, BLANK, stroke, inverted);
                 } else {
-                    image->drawRoundedRectangle(ix, iy, iw, ih, roundness, inset, stroke, BLANK, inverted);
+                    image->drawRoundedRectangle(ix, iy, iw, ih, roundness, shape.inset, stroke, BLANK, inverted);
                 }
             } break;
 
             case GC: {
                 const Color stroke = color == 'W' ? WHITE : BLACK;
-                float ir = diameter / 2;
+                float ir = shape.diameter / 2;
                 float ix = x + offset_x + ir;
                 float iy = y + offset_y + ir;
-                float full = inset >= ir;
+                float full = shape.inset >= ir;
                 if (full) {
                     image->drawCircle(ix, iy, ir, 0, BLANK, stroke, inverted);
                 } else {
-                    image->drawCircle(ix, iy, ir, inset, stroke, BLANK, inverted);
+                    image->drawCircle(ix, iy, ir, shape.inset, stroke, BLANK, inverted);
                 }
             } break;
 
@@ -246,18 +368,18 @@ struct ZPL_element {
                 const Color stroke = color == 'W' ? WHITE : BLACK;
                 float ix = x + offset_x;
                 float iy = y + offset_y;
-                float iw = width;
-                float ih = height;
-                image->drawDiagonalZPL(ix, iy, iw, ih, direction, inset, stroke, inverted);
+                float iw = shape.width;
+                float ih = shape.height;
+                image->drawDiagonalZPL(ix, iy, iw, ih, shape.direction, shape.inset, stroke, inverted);
             } break;
 
             case GE: {
                 const Color stroke = color == 'W' ? WHITE : BLACK;
-                float ix = x + offset_x + width / 2;
-                float iy = y + offset_y + height / 2;
-                float iw = width;
-                float ih = height;
-                image->drawEllipse(ix, iy, iw, ih, inset, stroke, BLANK, inverted);
+                float ix = x + offset_x + shape.width / 2;
+                float iy = y + offset_y + shape.height / 2;
+                float iw = shape.width;
+                float ih = shape.height;
+                image->drawEllipse(ix, iy, iw, ih, shape.inset, stroke, BLANK, inverted);
             } break;
 
 
@@ -265,79 +387,41 @@ struct ZPL_element {
                 float ix = x + offset_x;
                 float iy = y + offset_y;
                 const Color stroke = color == 'W' ? WHITE : BLACK;
-                bool font_found = true;
-                std::string font_name = "Helvetica";
-                switch (font_type) {
-                    case 0: font_name = "Helvetica"; break;
-                    case 1: font_name = "OCR-A"; break;
-                    case 2: font_name = "OCR-B"; break;
-                    case 3: font_name = "Roboto-Regular"; break;
-                    default: {
-                        notifyf("Unknown font type %d\n", font_type);
-                        font_found = false;
-                        break;
-                    }
+                const char* font_name = fontName();
+                if (!font_name) {
+                    notifyf("Unknown font type %d\n", field.font_type);
+                    return;
                 }
-                if (!font_found) return;
-                image->drawText(ix, iy, font_size, text.c_str(), font_name.c_str(), stroke, inverted);
+                image->drawText(ix, iy, field.font_size, field.text.data, font_name, stroke, inverted);
             } break;
 
             case GF: {
-                // Draw custom graphic field
-                // A halfbyte represents 4x1 pixels in the image
-                float scaling_factor = 1;
-                if (use_halfbyte) {
-                    for (float iy = 0; iy < height; iy++) {
-                        for (float ix = 0; ix < width; ix++) {
-                            int halfbyte = bitmap[((int) iy) * width + ((int) ix)];
-                            for (int i = 0; i < 4; i++) {
-                                int bit = (halfbyte >> (3 - i)) & 1;
-                                // if (bit) DrawPixel(x + ix * 4.0 * scaling_factor + i, y + iy * scaling_factor, BLACK);
-                                int _x = x + offset_x + ix * 4.0 * scaling_factor + i;
-                                int _y = y + offset_y + iy * scaling_factor;
-                                if (bit) image->drawPixel(_x, _y, BLACK, inverted);
-                            }
-                        }
-                    }
-                } else { // Use full 8 bit bytes
-                    for (float iy = 0; iy < height; iy++) {
-                        for (float ix = 0; ix < width; ix++) {
-                            int byte = bitmap[((int) iy) * width + ((int) ix)];
-                            for (int i = 0; i < 8; i++) {
-                                int bit = (byte >> (7 - i)) & 1;
-                                // if (bit) DrawPixel(x + ix * 8.0 * scaling_factor + i, y + iy * scaling_factor, BLACK);
-                                int _x = x + offset_x + ix * 8.0 * scaling_factor + i;
-                                int _y = y + offset_y + iy * scaling_factor;
-                                if (bit) image->drawPixel(_x, _y, BLACK, inverted);
-                            }
-                        }
-                    }
-
-                }
+                // Draw custom graphic field, ^FR toggles the dots instead of setting them
+                image->blitBitmap(x + offset_x, y + offset_y, graphic.bitmap, graphic.width, graphic.width * 8, graphic.height, BLACK, inverted);
             } break;
 
             case B3: {
                 // orientation
-                bool checksum = check == 'Y';
-                bool show = interpretation == 'Y';
+                bool checksum = barcode.check == 'Y';
+                bool show = barcode.interpretation == 'Y';
                 int ix = x + offset_x;
                 int iy = y + offset_y;
-                int h = barcode_height;
-                int w = barcode_width;
+                int h = barcode.height;
+                int w = barcode.width;
                 // interpretation_above
-                ImageDrawBarcode_Code39(image, text.c_str(), ix, iy, h, w, show, checksum, inverted);
+                ImageDrawBarcode_Code39(image, barcode.text.data, ix, iy, h, w, show, checksum, inverted);
             } break;
 
             case BC: {
                 // orientation
                 // bool checksum = check == 'Y'; // Unused
-                bool show = interpretation != 'N';
+                bool show = barcode.interpretation != 'N';
                 int ix = x + offset_x;
                 int iy = y + offset_y;
-                int h = barcode_height;
-                int w = barcode_width;
+                int h = barcode.height;
+                int w = barcode.width;
                 // interpretation_above
-                ImageDrawBarcode_Code128(image, text.c_str(), ix, iy, h, w, show, mode, inverted);
+                ImageDrawBarcode_Code128(image, barcode.text.data, ix, iy, h, w, show, barcode.mode, inverted);
             } break;
 
             default: {
@@ -345,6 +429,65 @@ struct ZPL_element {
             } break;
         }
     }
+
+    // Draw the element as vector shapes with the label home set by layout, mirroring the geometry of draw
+    void drawVector(VectorWriter& writer) {
+        int ix = x + home_x;
+        int iy = y + home_y;
+        bool white = color == 'W';
+        switch (type) {
+            case GB: {
+                float roundness = (float) (shape.radius < 0 ? 0 : shape.radius > 8 ? 8 : shape.radius) / 8.0f;
+                int shortHalf = shape.width < shape.height ? shape.width / 2 : shape.height / 2;
+                int corner = roundness * std::min(shape.width, shape.height) / 2;
+                writer.rect(ix, iy, shape.width, shape.height, corner, shape.inset >= shortHalf ? 0 : shape.inset, white, inverted);
+            } break;
+
+            case GC: {
+                int r = shape.diameter / 2;
+                writer.ellipse(ix + r, iy + r, r, r, shape.inset >= r ? 0 : shape.inset, white, inverted);
+            } break;
+
+            case GD: {
+                // Rows [y, y + height) span [left, left + inset) with left moving linearly across the width
+                if (shape.direction != 'L' && shape.direction != 'R') break;
+                int top = shape.direction == 'L' ? ix : ix + shape.width;
+                int bottom = shape.direction == 'L' ? ix + shape.width : ix;
+                double points[8] = { (double) top, (double) iy, (double) top + shape.inset, (double) iy,
+                                     (double) bottom + shape.inset, (double) iy + shape.height, (double) bottom, (double) iy + shape.height };
+                writer.polygon(points, 4, white, inverted);
+            } break;
+
+            case GE: {
+                int rw = shape.width / 2;
+                int rh = shape.height / 2;
+                writer.ellipse(ix + rw, iy + rh, rw, rh, shape.inset >= std::min(rw, rh) ? 0 : shape.inset, white, inverted);
+            } break;
+
+            case FD: {
+                const char* font_name = fontName();
+                if (!font_name) break;
+                const char* str = field.text.data;
+                writer.text(ix, iy, field.font_size, str, font_name, white, inverted);
+            } break;
+
+            case GF: {
+                writer.bitmap(ix, iy, graphic.bitmap, graphic.width, graphic.width * 8, graphic.height, inverted);
+            } break;
+
+            case B3: {
+                const char* str = barcode.text.data;
+                VectorDrawBarcode_Code39(&writer, str, ix, iy, barcode.height, barcode.width, barcode.interpretation == 'Y', barcode.check == 'Y', inverted);
+            } break;
+
+            case BC: {
+                const char* str = barcode.text.data;
+                VectorDrawBarcode_Code128(&writer, str, ix, iy, barcode.height, barcode.width, barcode.interpretation != 'N', barcode.mode, inverted);
+            } break;
+
+            default: break; // Draws nothing
+        }
+    }
 };
 
 struct ZPL_state {
@@ -418,42 +561,49 @@ int hexCharToNum(char hex) {
 
 struct ZPL_RLE_parser {
     StringView str;
-    int idx = 0;
-    int pixel_count = 0;
-    int width = 0; // 1/4 in size of the actual pixed count width
+    int idx = 0; // Halfbyte being written
+    int pixel_count = 0; // Halfbytes in the bitmap
+    int width = 0; // Halfbytes per row, 1/4 of the pixel width
     int height = 0; // 1/1 in size of the actual pixed count height
     int error = 0;
     const char* message = nullptr;
-    void _push(std::vector<uint8_t>& bitmap, uint8_t halfbyte, int repeat = 1) {
+    // The bitmap is packed 2 halfbytes per byte, rows hold an even number of halfbytes so they stay byte aligned
+    void _set(uint8_t* bitmap, int i, uint8_t halfbyte) {
+        uint8_t& byte = bitmap[i >> 1];
+        if (i & 1) byte = (byte & 0xF0) | halfbyte;
+        else byte = (byte & 0x0F) | (halfbyte << 4);
+    }
+    void _push(uint8_t* bitmap, uint8_t halfbyte, int repeat = 1) {
         if ((idx + repeat) > pixel_count) {
             // error = 1;
             // message = "Too many pixels";
             return;
         }
-        for (int i = 0; i < repeat; i++) {
-            bitmap[idx++] = halfbyte;
+        if (repeat <= 0) return;
+        if (idx & 1) {
+            _set(bitmap, idx++, halfbyte);
+            repeat--;
         }
+        // Whole bytes at once
+        int pairs = repeat / 2;
+        memset(bitmap + (idx >> 1), halfbyte * 0x11, pairs);
+        idx += pairs * 2;
+        if (repeat & 1) _set(bitmap, idx++, halfbyte);
     }
-    void _copy_previous_row(std::vector<uint8_t>& bitmap) { // Symbol ':'
+    void _copy_previous_row(uint8_t* bitmap) { // Symbol ':'
         // Override current row with previous row and set index to the start of the next row
         int row = idx / width;
-        int previous = row > 0 ? (row - 1) * width : 0;
+        if (row >= height) return;
         int start = row * width;
-        if (row > 0) {
-            for (int i = 0; i < width; i++) {
-                bitmap[start + i] = bitmap[previous + i];
-            }
-        }
+        if (row > 0) memcpy(&bitmap[start / 2], &bitmap[(start - width) / 2], width / 2);
         idx = start + width;
     }
-    void _fill_remaining_row(std::vector<uint8_t>& bitmap) { // Symbol '!'
+    void _fill_remaining_row(uint8_t* bitmap) { // Symbol '!'
         // Fill the rest of the row with the 0xF half bytes until the end of the row
         int row = idx / width;
+        if (row >= height) return;
         int start = row * width;
-        for (int i = idx; i < start + width; i++) {
-            bitmap[i] = 0xF;
-        }
-        idx = start + width;
+        _push(bitmap, 0xF, start + width - idx);
     }
     void _fill_empty_row() { // Symbol ','
         // Skip the rest of the row and set index to the start of the next row
@@ -468,30 +618,34 @@ struct ZPL_RLE_parser {
         if (c >= 'G') return 1;
         return 0;
     }
-    bool parse(int byte_count, int column_count, StringView& str, std::vector<uint8_t>& bitmap, char caret) { // A,4096,4096,32,,:::::::::::::hY03........
+    // Decode into a bitmap taken from the arena, left as nullptr when the field is invalid
+    bool parse(int byte_count, int column_count, StringView& str, Arena& arena, uint8_t*& bitmap, char caret) { // A,4096,4096,32,,:::::::::::::hY03........
         this->str = str;
         this->idx = 0;
         this->error = 0;
         this->message = nullptr;
-        bitmap.clear();
+        bitmap = nullptr;
 
+        if (byte_count <= 0 || column_count <= 0) {
+            error = 1;
+            message = "Invalid graphic field size";
+            return false;
+        }
         width = column_count * 2;
         height = (byte_count * 2) / width;
         pixel_count = width * height;
 
-        bitmap.resize(pixel_count);
-        for (int i = 0; i < pixel_count; i++) {
-            bitmap[i] = 0;
-        }
         int len = str.length();
-        if (len < 2) {
+        if (len < 1) {
             error = 1;
             message = "Empty RLE string";
             return false;
         }
-        int idx = 1;
+        bitmap = arena.zeroed(pixel_count / 2);
+        const char* data = str.data();
+        int idx = 0;
         while (idx < len) {
-            char c = str[idx++];
+            char c = data[idx++];
             if (c == caret) break;
             if (c == ',') {
                 _fill_empty_row();
@@ -507,15 +661,23 @@ struct ZPL_RLE_parser {
             }
             int value = hexCharToNum(c);
             if (value >= 0) {
+                // Two plain digits starting on a byte are stored as that byte
+                int low = idx < len ? hexCharToNum(data[idx]) : -1;
+                if (low >= 0 && !(this->idx & 1) && this->idx + 2 <= pixel_count) {
+                    bitmap[this->idx >> 1] = value << 4 | low;
+                    this->idx += 2;
+                    idx++;
+                    continue;
+                }
                 _push(bitmap, value, 1);
                 continue;
             }
             int repeat = getRepeat(c);
-            char next = str[idx++];
+            char next = idx < len ? data[idx++] : caret;
             if (next == caret) break;
             while (getRepeat(next) > 0) {
                 repeat += getRepeat(next);
-                next = str[idx++];
+                next = idx < len ? data[idx++] : caret;
             }
             if (next == caret) break;
             value = hexCharToNum(next);
@@ -529,13 +691,12 @@ struct ZPL_RLE_parser {
         }
         return true;
     }
-} rle_parser;
+};
 
 struct ZPL_Z64_parser {
     StringView str;
-    int width = 0; // 1/8 in size of the actual pixed count width
+    int width = 0; // Bytes per row, 1/8 of the pixel width
     int height = 0; // 1/1 in size of the actual pixed count height
-    std::vector<uint8_t> inflated;
     int error = 0;
     int idx = 0;
     const char* message = nullptr;
@@ -544,26 +705,125 @@ struct ZPL_Z64_parser {
     // 2. Decode Base64 to binary
     // 3. Inflate the binary data using zlib
 
-    bool parse(int byte_count, int column_count, StringView& str, std::vector<uint8_t>& bitmap, char caret) {
-        width = column_count;
-        height = (byte_count) / width;
+    bool parse(int byte_count, int column_count, StringView& str, Arena& arena, uint8_t*& bitmap, char caret) {
         error = 0;
         idx = 0;
         message = nullptr;
+        bitmap = nullptr;
+        if (byte_count <= 0 || column_count <= 0) {
+            error = 1;
+            message = "Invalid graphic field size";
+            return false;
+        }
+        width = column_count;
+        height = (byte_count) / width;
         this->str = str;
-        bitmap.clear();
-        // Decode Base64
-        std::string binary = b64decode(str.c_str(), str.length());
-        int result = zlibDecompress(binary, bitmap, width * height);
-        if (result != Z_OK) {
+        // Decode Base64, the binary only lives until the label is cleared
+        uLong binary_length = b64decodedLength(str.data(), str.length());
+        uint8_t* binary = (uint8_t*) arena.allocate(binary_length);
+        b64decode(str.data(), str.length(), binary);
+        // The blitter reads whole rows, data short of that leaves the rest blank. More data than the field holds is cut off
+        size_t size = (size_t) width * height;
+        uint8_t* inflated = arena.zeroed(size);
+        if (inflate(arena, binary, binary_length, inflated, size)) {
             error = 1;
             message = "Failed to decompress Z64 data";
             return false;
         }
+        bitmap = inflated;
         return true;
     }
-} z64_parser;
 
+    // Inflate a zlib stream into size bytes. zlib takes its state and window from the arena too
+    static int inflate(Arena& arena, const uint8_t* data, size_t length, uint8_t* out, size_t size) {
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        stream.zalloc = [](voidpf opaque, uInt items, uInt size) -> voidpf { return ((Arena*) opaque)->allocate((size_t) items * size); };
+        stream.zfree = [](voidpf, voidpf) {};
+        stream.opaque = &arena;
+        if (inflateInit(&stream) != Z_OK) return 1;
+        stream.next_in = (Bytef*) data;
+        stream.avail_in = (uInt) length;
+        stream.next_out = out;
+        stream.avail_out = (uInt) size;
+        int result = ::inflate(&stream, Z_FINISH);
+        inflateEnd(&stream);
+        // A full bitmap with data left over is kept, like a short one
+        return result == Z_STREAM_END || (result == Z_BUF_ERROR && stream.avail_out == 0) ? 0 : 1;
+    }
+};
+
+
+// Uniform grid over the label where every cell lists the elements whose bounding box overlaps it, in label order
+struct ZPL_grid {
+    int cell = ZPL_GRID_MIN_CELL; // Cell size in dots
+    int cols = 0;
+    int rows = 0;
+    std::vector<int> starts; // The elements of cell i are items[starts[i]] .. items[starts[i + 1] - 1]
+    std::vector<int> items;
+
+    void build(ZPL_element* elements, int length) {
+        int max_x = 0;
+        int max_y = 0;
+        for (int i = 0; i < length; i++) {
+            if (!elements[i].isVisible()) continue;
+            max_x = std::max(max_x, elements[i].box_x1);
+            max_y = std::max(max_y, elements[i].box_y1);
+        }
+        cell = std::max(ZPL_GRID_MIN_CELL, (std::max(max_x, max_y) + ZPL_GRID_CELLS - 1) / ZPL_GRID_CELLS);
+        cols = (max_x + cell - 1) / cell;
+        rows = (max_y + cell - 1) / cell;
+        starts.assign(cols * rows + 1, 0);
+        // Count the elements per cell, then place them in label order
+        for (int pass = 0; pass < 2; pass++) {
+            for (int i = 0; i < length; i++) {
+                ZPL_element& element = elements[i];
+                if (!element.isVisible()) continue;
+                int c0 = element.box_x0 / cell;
+                int r0 = element.box_y0 / cell;
+                int c1 = (element.box_x1 - 1) / cell;
+                int r1 = (element.box_y1 - 1) / cell;
+                for (int r = r0; r <= r1; r++) {
+                    for (int c = c0; c <= c1; c++) {
+                        if (pass == 0) starts[r * cols + c + 1]++;
+                        else items[starts[r * cols + c]++] = i;
+                    }
+                }
+            }
+            if (pass == 0) {
+                for (size_t i = 1; i < starts.size(); i++) starts[i] += starts[i - 1];
+                items.resize(starts.back());
+            } else {
+                // Placing moved every start to the next cell
+                for (size_t i = starts.size() - 1; i > 0; i--) starts[i] = starts[i - 1];
+                starts[0] = 0;
+            }
+        }
+    }
+
+    // Indices of the elements overlapping [x0, x1) x [y0, y1) in label order
+    void query(ZPL_element* elements, int x0, int y0, int x1, int y1, std::vector<int>& result) {
+        result.clear();
+        int c0 = std::max(x0, 0) / cell;
+        int r0 = std::max(y0, 0) / cell;
+        int c1 = std::min((x1 - 1) / cell, cols - 1);
+        int r1 = std::min((y1 - 1) / cell, rows - 1);
+        if (x1 <= 0 || y1 <= 0) return;
+        for (int r = r0; r <= r1; r++) {
+            for (int c = c0; c <= c1; c++) {
+                int cell_index = r * cols + c;
+                for (int k = starts[cell_index]; k < starts[cell_index + 1]; k++) {
+                    int i = items[k];
+                    ZPL_element& element = elements[i];
+                    // Report every element once, from the first cell of the query it falls in
+                    if (c != std::max(c0, element.box_x0 / cell) || r != std::max(r0, element.box_y0 / cell)) continue;
+                    if (element.overlaps(x0, y0, x1, y1)) result.push_back(i);
+                }
+            }
+        }
+        std::sort(result.begin(), result.end());
+    }
+};
 
 class ZPL_label {
 public:
@@ -581,14 +841,23 @@ public:
     int copies = 1;
 
     ZPL_state state;
-    ZPL_element elements[ZPL_MAX_ELEMENTS];
-    int length = 0;
+    std::vector<ZPL_element> elements; // In label order, clear() keeps the capacity
+    Arena arena; // Field text, comments and graphic bitmaps of the elements, released by clear()
     int barcode_awaiting_text = -1;
-    Image image;
+    Image image = Image(0, 0, WHITE, IF_MONO);
+    std::vector<Image> bands; // Per band canvases reused between renders
+    ZPL_grid grid;
+    int laid_out = -1; // Number of elements the bounding boxes and the grid were computed for
+    int threads = 0; // Number of bands it is rendered in, 0 = one per core, 1 = only on the calling thread
 
+    // The pointer is valid until the next element is added
     ZPL_element* nextElement() {
-        if (length >= ZPL_MAX_ELEMENTS) return nullptr;
-        return &elements[length++];
+        elements.push_back(ZPL_element());
+        return &elements.back();
+    }
+
+    int length() const {
+        return (int) elements.size();
     }
 
     void clear() {
@@ -598,13 +867,11 @@ public:
         column = 0;
         idx = 0;
         state.reading = false;
-        // if (state.text) free((void*) state.text);
-        // for (int i = 0; i < length; i++) {
-        //     if (elements[i].text) free((void*) elements[i].text);
-        //     if (elements[i].halfbytes) free(elements[i].halfbytes);
-        // }
         state.reset();
-        length = 0;
+        elements.clear();
+        arena.reset();
+        copies = 1;
+        laid_out = -1;
         barcode_awaiting_text = -1;
         label_home_x = 0;
         label_home_y = 0;
@@ -612,9 +879,34 @@ public:
         // label_height_parm = 0;
     }
 
+    // The settings clear() keeps: ^CF font, ^BY barcode defaults, ^PW width and ^LL length. A label of a stream starts
+    // with those the label before it left, as on a printer
+    void carryFrom(const ZPL_label& previous) {
+        state.font_type = previous.state.font_type;
+        state.font_size = previous.state.font_size;
+        state.barcode_width = previous.state.barcode_width;
+        state.barcode_wn_ratio = previous.state.barcode_wn_ratio;
+        state.barcode_height = previous.state.barcode_height;
+        label_width_parm = previous.label_width_parm;
+        label_height_parm = previous.label_height_parm;
+    }
+
+    // clear() and also the settings it keeps, for the first label of a new document
+    void clearAll() {
+        clear();
+        const ZPL_state defaults;
+        state.font_type = defaults.font_type;
+        state.font_size = defaults.font_size;
+        state.barcode_width = defaults.barcode_width;
+        state.barcode_wn_ratio = defaults.barcode_wn_ratio;
+        state.barcode_height = defaults.barcode_height;
+        label_width_parm = 0;
+        label_height_parm = 0;
+    }
+
     void print() {
-        printf("    Label with %d elements\n", length);
-        for (int i = 0; i < length; i++) {
+        printf("    Label with %d elements\n", length());
+        for (int i = 0; i < length(); i++) {
             ZPL_element& element = elements[i];
             element.print();
         }
@@ -627,10 +919,7 @@ public:
         if (width != image.width || height != image.height) {
             image.resize(width, height, WHITE);
         }
-        for (int i = 0; i < length; i++) {
-            ZPL_element& element = elements[i];
-            element.draw(&image, label_home_x, label_home_y);
-        }
+        drawElements(image);
         return &image;
     }
 
@@ -639,10 +928,165 @@ public:
             im.resize(label_width_parm, label_height_parm, WHITE);
         }
         if (im.width <= 0 || im.height <= 0) return;
-        for (int i = 0; i < length; i++) {
+        drawElements(im);
+    }
+
+    // Resolve the label home of every element, its bounding box and the spatial index
+    void layout() {
+        int home_x = label_home_x;
+        int home_y = label_home_y;
+        for (int i = 0; i < length(); i++) {
             ZPL_element& element = elements[i];
-            element.draw(&im, label_home_x, label_home_y);
+            if (element.type == LH) {
+                home_x = element.x;
+                home_y = element.y;
+            }
+            element.layout(home_x, home_y);
         }
+        grid.build(elements.data(), length());
+        laid_out = length();
+    }
+
+    // Draw the elements that overlap the rows [y0, y1) of the target. They are drawn in label order so ^FR inverts
+    // the same pixels no matter how the label is split into bands
+    void drawRows(Image& target, int y0, int y1) {
+        std::vector<int> visible;
+        grid.query(elements.data(), 0, y0, target.width, y1, visible);
+        for (int i : visible) {
+            ZPL_element& element = elements[i];
+            int offset_x = element.home_x;
+            int offset_y = element.home_y;
+            element.draw(&target, offset_x, offset_y);
+        }
+    }
+
+    void drawElements(Image& im) {
+        if (laid_out != length()) layout();
+        int count = threads > 0 ? threads : thread_pool.size();
+        count = std::min(count, im.height / ZPL_MIN_BAND_HEIGHT);
+        if (count <= 1 || im.band_y0 != 0 || im.band_y1 != im.height) {
+            drawRows(im, im.band_y0, im.band_y1);
+            return;
+        }
+        if ((int) bands.size() < count) bands.resize(count);
+        int band_height = (im.height + count - 1) / count;
+        thread_pool.run(count, [&](int b) {
+            int y0 = b * band_height;
+            int y1 = std::min(y0 + band_height, im.height);
+            Image& band = bands[b];
+            band.setFormat(im.format);
+            band.setBand(im.width, im.height, y0, y1, im.background);
+            // Start from the rows the image already has drawn
+            if (im.isDirty() && im.dirty_y0 < y1 && im.dirty_y1 > y0) {
+                int r0 = std::max(im.dirty_y0, y0);
+                int r1 = std::min(im.dirty_y1, y1);
+                band.copyRows(im, r0, r1);
+                band.markDirty(0, r0, im.width, r1);
+            }
+            drawRows(band, y0, y1);
+            if (band.isDirty()) {
+                int r0 = band.dirty_y0;
+                int r1 = band.dirty_y1;
+                im.copyRows(band, r0, r1);
+            }
+        });
+        for (int b = 0; b < count; b++) {
+            Image& band = bands[b];
+            if (band.isDirty()) im.markDirty(band.dirty_x0, band.dirty_y0, band.dirty_x1, band.dirty_y1);
+        }
+    }
+
+    // Write the label as SVG or EPS shapes in label order, skipping rasterization entirely
+    void drawVector(VectorWriter& writer, int width, int height) {
+        if (label_width_parm > 0 && label_height_parm > 0) {
+            width = label_width_parm;
+            height = label_height_parm;
+        }
+        if (laid_out != length()) layout();
+        writer.begin(width, height);
+        for (int i = 0; i < length(); i++) {
+            if (elements[i].isVisible()) elements[i].drawVector(writer);
+        }
+        writer.end();
+    }
+
+    // Render a monochrome label band by band straight into a PNG stream, without ever holding the whole label.
+    // Only a few batches of bands exist at a time. Returns 0 on success
+    int drawStreamed(int width, int height, PngEncoder& encoder, const PngSink& sink) {
+        if (label_width_parm > 0 && label_height_parm > 0) {
+            width = label_width_parm;
+            height = label_height_parm;
+        }
+        if (width <= 0 || height <= 0) return 1;
+        if (laid_out != length()) layout();
+        int band_count = (height + ZPL_STREAM_BAND_HEIGHT - 1) / ZPL_STREAM_BAND_HEIGHT;
+        int batch = threads > 0 ? threads : thread_pool.size();
+        batch = std::max(1, std::min(batch, band_count));
+        auto drawBand = [&](int k, Image& band) {
+            int y0 = k * ZPL_STREAM_BAND_HEIGHT;
+            int y1 = std::min(y0 + ZPL_STREAM_BAND_HEIGHT, height);
+            band.setFormat(IF_MONO);
+            band.setBand(width, height, y0, y1, WHITE);
+            drawRows(band, y0, y1);
+        };
+
+        if (batch > 1) {
+            // Every step deflates the batch drawn in the step before while drawing the next one, all on the pool.
+            // Each band is its own deflate piece, primed with the band above it, so slots hold three batches:
+            // the one being drawn, the one being deflated and the one before that
+            int slots = batch * 3;
+            if ((int) bands.size() < slots) bands.resize(slots);
+            if (encoder.beginStream(width, height, sink, batch)) return 1;
+            int batches = (band_count + batch - 1) / batch;
+            for (int t = 0; t <= batches; t++) {
+                int draw_start = t * batch;
+                int draw_n = t < batches ? std::min(batch, band_count - draw_start) : 0;
+                int deflate_start = (t - 1) * batch;
+                int deflate_n = t > 0 ? std::min(batch, band_count - deflate_start) : 0;
+                thread_pool.run(deflate_n + draw_n, [&](int j) {
+                    if (j >= deflate_n) {
+                        int k = draw_start + j - deflate_n;
+                        drawBand(k, bands[k % slots]);
+                        return;
+                    }
+                    int k = deflate_start + j;
+                    Image& band = bands[k % slots];
+                    const uint8_t* previous = nullptr;
+                    int previous_count = 0;
+                    if (k > 0) {
+                        Image& above = bands[(k - 1) % slots];
+                        previous_count = above.band_y1 - above.band_y0;
+                        previous = above.row(above.band_y0) + (size_t) previous_count * above.stride;
+                    }
+                    encoder.deflatePiece(j, band.row(band.band_y0), band.stride, band.band_y1 - band.band_y0, previous, previous_count, k == band_count - 1);
+                });
+                for (int j = 0; j < deflate_n; j++) {
+                    if (encoder.writePiece(j)) return 1;
+                }
+            }
+            return encoder.endStream();
+        }
+
+        // A single render thread: every step draws a band while a worker of the pool deflates the one before it. With
+        // the pool busy elsewhere the two run one after the other on the calling thread
+        int slots = 2;
+        if ((int) bands.size() < slots) bands.resize(slots);
+        if (encoder.beginStream(width, height, sink)) return 1;
+        int stream_error = 0;
+        for (int k = 0; k <= band_count; k++) {
+            int deflate_n = k > 0 ? 1 : 0;
+            int draw_n = k < band_count ? 1 : 0;
+            thread_pool.run(deflate_n + draw_n, [&](int j) {
+                if (j >= deflate_n) {
+                    drawBand(k, bands[k % slots]);
+                    return;
+                }
+                Image& band = bands[(k - 1) % slots];
+                stream_error = encoder.streamRows(band.row(band.band_y0), band.stride, band.band_y1 - band.band_y0);
+            });
+            if (stream_error) return stream_error;
+        }
+        return encoder.endStream();
     }
 };
 
@@ -663,33 +1107,10 @@ bool isWhitespace(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\
 
 ZPL_CMD decodeCommand(StringView& str, char caret) {
     while (str.length() > 0 && !isCapitalChar(str[0]) && str[0] != caret) str.shift();
-    if (str[0] == caret) return UNKNOWN;
-    if (str.length() < 2) return UNKNOWN;
-    StringView command = str.shift(2);
-    if (command.startsWith("XA")) return XA;
-    if (command.startsWith("XZ")) return XZ;
-    if (command.startsWith("CC")) return CC;
-    if (command.startsWith("CD")) return CD;
-    if (command.startsWith("CF")) return CF;
-    if (command.startsWith("PW")) return PW;
-    if (command.startsWith("LL")) return LL;
-    if (command.startsWith("LH")) return LH;
-    if (command.startsWith("PQ")) return PQ;
-    if (command.startsWith("SN")) return SN;
-    if (command.startsWith("FO")) return FO;
-    if (command.startsWith("FR")) return FR;
-    if (command.startsWith("GB")) return GB;
-    if (command.startsWith("GC")) return GC;
-    if (command.startsWith("GD")) return GD;
-    if (command.startsWith("GE")) return GE;
-    if (command.startsWith("FD")) return FD;
-    if (command.startsWith("FX")) return FX;
-    if (command.startsWith("FS")) return FS;
-    if (command.startsWith("BY")) return BY;
-    if (command.startsWith("B3")) return B3;
-    if (command.startsWith("BC")) return BC;
-    if (command.startsWith("GF")) return GF;
-    return UNKNOWN;
+    if (str.length() < 2 || str[0] == caret) return UNKNOWN;
+    ZPL_CMD command = zpl_commands.find(str.data());
+    str.shift(2);
+    return command;
 }
 
 ZPL_parsing_error parseNumber(char caret, char delimiter, StringView& str, int& number, bool required = false) {
@@ -728,30 +1149,33 @@ ZPL_parsing_error parseNumber(char caret, char delimiter, StringView& str, int&
 }
 
 
-ZPL_parsing_error parseString(char caret, char delimiter, StringView& str, char* text, bool required = false, bool ignoreDelimiter = false) {
+// The text is copied to the arena without tabs and line breaks and is zero terminated, an empty view when missing
+ZPL_parsing_error parseString(char caret, char delimiter, StringView& str, Arena& arena, StringView& text, bool required = false, bool ignoreDelimiter = false) {
     int count = 0;
     int skipDelimiter = 0;
+    text = StringView("", 0);
     if (str.length() == 0) return (ZPL_parsing_error) { 0, 1, 0, "Empty string", 0, 0 };
     if (str[0] == delimiter || str[0] == caret) {
         if (required) return (ZPL_parsing_error) { 0, 1, 0, "Missing required string", 0, 0 };
         if (str[0] == delimiter) skipDelimiter = 1;
         return (ZPL_parsing_error) { skipDelimiter, 0, 0, "", 0, 0 };
     }
-    for (int i = 0; i < str.length(); i++) {
-        if (str[i] == delimiter && !ignoreDelimiter) {
-            skipDelimiter = 1;
-            break;
-        }
-        if (str[i] == caret) break;
-        if (str[i] == '\t') continue;
-        if (str[i] == '\r') continue;
-        if (str[i] == '\n') continue;
-        text[count++] = str[i];
+    // Find the end of the field first so the copy is sized to it
+    int end = 0;
+    int length = str.length();
+    const char* data = str.data();
+    while (end < length && data[end] != caret && (ignoreDelimiter || data[end] != delimiter)) end++;
+    if (end < length && data[end] == delimiter && !ignoreDelimiter) skipDelimiter = 1;
+    char* copy = (char*) arena.allocate(end + 1);
+    for (int i = 0; i < end; i++) {
+        if (data[i] == '\t' || data[i] == '\r' || data[i] == '\n') continue;
+        copy[count++] = data[i];
     }
-    text[count] = '\0';
+    copy[count] = '\0';
     if (count == 0) {
         if (required) return (ZPL_parsing_error) { 0, 1, 0, "Missing required string", 0, 0 };
     }
+    text = StringView(copy, count);
     return (ZPL_parsing_error) { count + skipDelimiter, 0, 0, "", 0, 0 };
 }
 
@@ -798,7 +1222,7 @@ int string_length(char* str) {
     return len;
 }
 
-std::string* lineAt(std::string* str, int index, int* offset = nullptr, int* row = nullptr) {
+std::string* lineAt(const std::string* str, int index, int* offset = nullptr, int* row = nullptr) {
     // Index is the character index in the string as a character array index
     // Offset is the column in the line where the index is located
     // Row is the line number where the index is located
@@ -825,7 +1249,7 @@ std::string* lineAt(std::string* str, int index, int* offset = nullptr, int* row
 }
 
 #define ZPL_THROW(cmp, ...)  if (cmp) {label.errorObj = __VA_ARGS__; label.error = label.errorObj.error; label.message = label.errorObj.message; label.line = label.errorObj.line; label.column = label.errorObj.column; label.idx = c.offset(); return &label; }
-#define ZPL_GET_ELEMENT() ZPL_element* element = label.nextElement(); if (!element) { label.error = 1; label.message = "Too many elements"; return &label; }
+#define ZPL_GET_ELEMENT() ZPL_element* element = label.nextElement();
 
 #define Z_REQUIRED true
 #define Z_OPTIONAL false
@@ -834,7 +1258,7 @@ std::string* lineAt(std::string* str, int index, int* offset = nullptr, int* row
 #define WITHOUT_DELIMITER false
 
 #define ZPL_PARSE_NUMBER(number, required) { err = parseNumber(caret, delimiter, c, number, required); ZPL_THROW(err.error, err); c.shift(err.parsed); }
-#define ZPL_PARSE_STRING(str, required, ignoreDelimiter) { err = parseString(caret, delimiter, c, str, required, ignoreDelimiter); ZPL_THROW(err.error, err); c.shift(err.parsed); }
+#define ZPL_PARSE_STRING(str, required, ignoreDelimiter) { err = parseString(caret, delimiter, c, label.arena, str, required, ignoreDelimiter); ZPL_THROW(err.error, err); c.shift(err.parsed); }
 #define ZPL_PARSE_CHAR(character, required) { err = parseChar(caret, delimiter, c, character, required); ZPL_THROW(err.error, err); c.shift(err.parsed); }
 
 
@@ -845,9 +1269,31 @@ ZPL_parsing_error skipDelimiter(char delimiter, const char* str, bool required =
     return (ZPL_parsing_error) { 0, 0, 0, "", 0, 0 };
 }
 
-ZPL_label label;
-ZPL_label* parse_zpl(const std::string* zpl_text, int debug_level = 1) {
-    label.clear();
+struct ZPL_render_slot {
+    Image canvas = Image(0, 0, WHITE, IF_MONO);
+    PngEncoder encoder;
+};
+
+// Everything a conversion changes: the label being parsed, the graphic field decoders, the canvas, the PNG encoder and
+// the debug timers. Separate contexts can convert on separate threads at the same time. They only share the glyph cache
+// and the thread pool, which lock themselves, and the barcode callbacks, which keep their state per thread
+struct ZPL_context {
+    ZPL_label label; // The label being parsed on its own, as by zpl2pdf and ZPL_stream
+    ZPL_RLE_parser rle_parser;
+    ZPL_Z64_parser z64_parser;
+    Image image = Image(0, 0, WHITE, IF_MONO); // Canvas, its format sets the color depth of the output
+    PngEncoder png;
+    StopWatch timer;
+    int threads = 0; // Number of bands a label is rendered in, 0 = one per core, 1 = only on the calling thread
+    std::vector<std::unique_ptr<ZPL_label>> labels; // Labels of the last parsed stream, kept with their arenas
+    std::vector<std::unique_ptr<ZPL_render_slot>> slots; // One per worker rendering whole labels
+};
+
+// Parse the commands in c into label, which the caller has cleared. With until_end the label ends at its ^XZ and c is
+// left just past it, otherwise every command of the text goes into the one label
+ZPL_label* parse_zpl(ZPL_context& context, ZPL_label& label, StringView& c, int debug_level = 1, bool until_end = false) {
+    auto& rle_parser = context.rle_parser;
+    auto& z64_parser = context.z64_parser;
     auto& idx = label.idx;
     auto& state = label.state;
     auto& caret = state.caret;
@@ -862,32 +1308,26 @@ ZPL_label* parse_zpl(const std::string* zpl_text, int debug_level = 1) {
     auto& color = state.color;
     auto& inverted = state.inverted;
 
-
-    // Parse ZPL text
-    StringView c = StringView(*zpl_text);
-
-
-    char* temp = (char*) malloc(ZPL_MAX_STRING);
+    StringView arg; // String argument of the command, copied to the label arena
 
     ZPL_CMD cmd = UNKNOWN;
     ZPL_parsing_error err;
-    while (c.length()) {
+    bool ended = false;
+    while (c.length() && !ended) {
         if (c[idx] != caret) {
-            c.shift();
+            c.skipTo(caret); // memchr jumps over field data and comments to the next command
             continue;
         }
         if (c.length() < 3) break;
         c.shift(); // Skip caret
         StringView cmd_str = c;
 
-        temp[0] = 0;
-
         int skip = 0;
         cmd = decodeCommand(c, caret);
         if (cmd == UNKNOWN) {
             cmd_str.subtract(c); // Get the command string
             if (debug_level > 0) {
-                printf("Unknown command: ^%s\n", cmd_str.c_str());
+                printf("Unknown command: ^%.*s\n", (int) cmd_str.length(), cmd_str.data());
             }
             continue;
         }
@@ -896,20 +1336,18 @@ ZPL_label* parse_zpl(const std::string* zpl_text, int debug_level = 1) {
             case XA: {
                 reading = true;
                 ZPL_GET_ELEMENT();
-                element->str = cmd_str.subtract(c);
                 element->type = cmd;
             } break;
             case XZ: {
                 reading = false;
                 ZPL_GET_ELEMENT();
-                element->str = cmd_str.subtract(c);
                 element->type = cmd;
+                ended = until_end;
             } break;
             case CC: {
                 // ^CC/
                 caret = c.shift();
                 ZPL_GET_ELEMENT();
-                element->str = cmd_str.subtract(c);
                 element->type = cmd;
                 element->character = caret;
             } break;
@@ -917,7 +1355,6 @@ ZPL_label* parse_zpl(const std::string* zpl_text, int debug_level = 1) {
                 // ^CD;
                 delimiter = c.shift();
                 ZPL_GET_ELEMENT();
-                element->str = cmd_str.subtract(c);
                 element->type = cmd;
                 element->character = delimiter;
             } break;
@@ -928,12 +1365,11 @@ ZPL_label* parse_zpl(const std::string* zpl_text, int debug_level = 1) {
                 ZPL_PARSE_CHAR(font, Z_OPTIONAL);
                 ZPL_PARSE_NUMBER(state.font_size, Z_OPTIONAL);
                 ZPL_GET_ELEMENT();
-                element->str = cmd_str.subtract(c);
                 element->type = cmd;
                 if (font >= '0' && font <= '3') state.font_type = font - '0';
                 if (font >= 'A') state.font_type = font - 'A' + 1;
-                element->font_type = state.font_type;
-                element->font_size = state.font_size;
+                element->field.font_type = state.font_type;
+                element->field.font_size = state.font_size;
             } break;
 
             case PW: {
@@ -957,7 +1393,6 @@ ZPL_label* parse_zpl(const std::string* zpl_text, int debug_level = 1) {
                 ZPL_PARSE_NUMBER(x, Z_REQUIRED);
                 ZPL_PARSE_NUMBER(y, Z_REQUIRED);
                 ZPL_GET_ELEMENT();
-                element->str = cmd_str.subtract(c);
                 element->type = cmd;
                 element->x = x;
                 element->y = y;
@@ -971,7 +1406,6 @@ ZPL_label* parse_zpl(const std::string* zpl_text, int debug_level = 1) {
                 ZPL_PARSE_NUMBER(copies, Z_REQUIRED);
                 if (copies < 1) copies = 1;
                 ZPL_GET_ELEMENT();
-                element->str = cmd_str.subtract(c);
                 element->type = cmd;
                 element->x = copies;
                 label.copies = copies;
@@ -979,18 +1413,17 @@ ZPL_label* parse_zpl(const std::string* zpl_text, int debug_level = 1) {
 
             case SN: {
                 // ^SN0001,1,Y
-                ZPL_PARSE_STRING(temp, Z_REQUIRED, WITHOUT_DELIMITER);
+                ZPL_PARSE_STRING(arg, Z_REQUIRED, WITHOUT_DELIMITER);
                 int increment = 1;
                 ZPL_PARSE_NUMBER(increment, Z_OPTIONAL);
-                char* temp2 = (char*) malloc(16);
-                ZPL_PARSE_CHAR(temp2[0], Z_OPTIONAL);
-                bool pad = temp2[0] == 'Y';
+                char pad_char = 'N';
+                ZPL_PARSE_CHAR(pad_char, Z_OPTIONAL);
+                bool pad = pad_char == 'Y';
                 ZPL_GET_ELEMENT();
-                element->str = cmd_str.subtract(c);
                 element->type = cmd;
-                element->text.deepCopy(temp);
-                element->increment = increment;
-                element->padding = pad;
+                element->serial.text = ZPL_text::of(arg);
+                element->serial.increment = increment;
+                element->serial.padding = pad;
             } break;
 
             case FO: {
@@ -998,7 +1431,6 @@ ZPL_label* parse_zpl(const std::string* zpl_text, int debug_level = 1) {
                 ZPL_PARSE_NUMBER(x, Z_REQUIRED);
                 ZPL_PARSE_NUMBER(y, Z_REQUIRED);
                 ZPL_GET_ELEMENT();
-                element->str = cmd_str.subtract(c);
                 element->type = cmd;
                 element->x = x;
                 element->y = y;
@@ -1007,7 +1439,6 @@ ZPL_label* parse_zpl(const std::string* zpl_text, int debug_level = 1) {
                 // ^FR
                 inverted = true;
                 ZPL_GET_ELEMENT();
-                element->str = cmd_str.subtract(c);
                 element->type = cmd;
                 element->inverted = inverted;
             } break;
@@ -1022,18 +1453,17 @@ ZPL_label* parse_zpl(const std::string* zpl_text, int debug_level = 1) {
                 ZPL_PARSE_NUMBER(width, Z_OPTIONAL);
                 ZPL_PARSE_NUMBER(height, Z_OPTIONAL);
                 ZPL_PARSE_NUMBER(inset, Z_OPTIONAL);
-                ZPL_PARSE_STRING(temp, Z_OPTIONAL, WITHOUT_DELIMITER);
-                if (temp[0] == 'B' || temp[0] == 'W') color = temp[0];
+                ZPL_PARSE_STRING(arg, Z_OPTIONAL, WITHOUT_DELIMITER);
+                if (arg.length() && (arg[0] == 'B' || arg[0] == 'W')) color = arg[0];
                 ZPL_PARSE_NUMBER(radius, Z_OPTIONAL);
                 ZPL_GET_ELEMENT();
-                element->str = cmd_str.subtract(c);
                 element->type = cmd;
                 element->x = x;
                 element->y = y;
-                element->width = width < 1 ? 1 : width;
-                element->height = height < 1 ? 1 : height;
-                element->inset = inset < 1 ? 1 : inset;
-                element->radius = radius;
+                element->shape.width = width < 1 ? 1 : width;
+                element->shape.height = height < 1 ? 1 : height;
+                element->shape.inset = inset < 1 ? 1 : inset;
+                element->shape.radius = radius;
                 element->color = color;
                 element->inverted = inverted;
                 state.reset();
@@ -1043,14 +1473,13 @@ ZPL_label* parse_zpl(const std::string* zpl_text, int debug_level = 1) {
                 // ^GC100,50
                 // ^GC100,50,W
                 ZPL_GET_ELEMENT();
-                element->diameter = 3;
-                element->inset = 1;
+                element->shape.diameter = 3;
+                element->shape.inset = 1;
                 element->color = 'B';
-                ZPL_PARSE_NUMBER(element->diameter, Z_OPTIONAL);
-                ZPL_PARSE_NUMBER(element->inset, Z_OPTIONAL);
-                ZPL_PARSE_STRING(temp, Z_OPTIONAL, WITHOUT_DELIMITER);
-                if (temp[0] == 'B' || temp[0] == 'W') element->color = temp[0];
-                element->str = cmd_str.subtract(c);
+                ZPL_PARSE_NUMBER(element->shape.diameter, Z_OPTIONAL);
+                ZPL_PARSE_NUMBER(element->shape.inset, Z_OPTIONAL);
+                ZPL_PARSE_STRING(arg, Z_OPTIONAL, WITHOUT_DELIMITER);
+                if (arg.length() && (arg[0] == 'B' || arg[0] == 'W')) element->color = arg[0];
                 element->type = cmd;
                 element->x = x;
                 element->y = y;
@@ -1061,18 +1490,17 @@ ZPL_label* parse_zpl(const std::string* zpl_text, int debug_level = 1) {
             case GD: {
                 // ^GD100,80,10,B,R
                 ZPL_GET_ELEMENT();
-                element->width = 3;
-                element->height = 3;
-                element->inset = 1;
+                element->shape.width = 3;
+                element->shape.height = 3;
+                element->shape.inset = 1;
                 element->color = 'B';
-                element->direction = 'R';
-                ZPL_PARSE_NUMBER(element->width, Z_OPTIONAL);
-                ZPL_PARSE_NUMBER(element->height, Z_OPTIONAL);
-                ZPL_PARSE_NUMBER(element->inset, Z_OPTIONAL);
-                ZPL_PARSE_STRING(temp, Z_OPTIONAL, WITHOUT_DELIMITER);
-                if (temp[0] == 'B' || temp[0] == 'W') element->color = temp[0];
-                ZPL_PARSE_CHAR(element->direction, Z_OPTIONAL);
-                element->str = cmd_str.subtract(c);
+                element->shape.direction = 'R';
+                ZPL_PARSE_NUMBER(element->shape.width, Z_OPTIONAL);
+                ZPL_PARSE_NUMBER(element->shape.height, Z_OPTIONAL);
+                ZPL_PARSE_NUMBER(element->shape.inset, Z_OPTIONAL);
+                ZPL_PARSE_STRING(arg, Z_OPTIONAL, WITHOUT_DELIMITER);
+                if (arg.length() && (arg[0] == 'B' || arg[0] == 'W')) element->color = arg[0];
+                ZPL_PARSE_CHAR(element->shape.direction, Z_OPTIONAL);
                 element->type = cmd;
                 element->x = x;
                 element->y = y;
@@ -1083,16 +1511,15 @@ ZPL_label* parse_zpl(const std::string* zpl_text, int debug_level = 1) {
             case GE: {
                 // ^GE100,50,3,B
                 ZPL_GET_ELEMENT();
-                element->width = 3;
-                element->height = 3;
-                element->inset = 1;
+                element->shape.width = 3;
+                element->shape.height = 3;
+                element->shape.inset = 1;
                 element->color = 'B';
-                ZPL_PARSE_NUMBER(element->width, Z_OPTIONAL);
-                ZPL_PARSE_NUMBER(element->height, Z_OPTIONAL);
-                ZPL_PARSE_NUMBER(element->inset, Z_OPTIONAL);
-                ZPL_PARSE_STRING(temp, Z_OPTIONAL, WITHOUT_DELIMITER);
-                if (temp[0] == 'B' || temp[0] == 'W') element->color = temp[0];
-                element->str = cmd_str.subtract(c);
+                ZPL_PARSE_NUMBER(element->shape.width, Z_OPTIONAL);
+                ZPL_PARSE_NUMBER(element->shape.height, Z_OPTIONAL);
+                ZPL_PARSE_NUMBER(element->shape.inset, Z_OPTIONAL);
+                ZPL_PARSE_STRING(arg, Z_OPTIONAL, WITHOUT_DELIMITER);
+                if (arg.length() && (arg[0] == 'B' || arg[0] == 'W')) element->color = arg[0];
                 element->type = cmd;
                 element->x = x;
                 element->y = y;
@@ -1102,10 +1529,10 @@ ZPL_label* parse_zpl(const std::string* zpl_text, int debug_level = 1) {
 
             case FD: {
                 // ^FDHello, World^FS
-                ZPL_PARSE_STRING(temp, Z_REQUIRED, WITH_DELIMITER);
+                ZPL_PARSE_STRING(arg, Z_REQUIRED, WITH_DELIMITER);
                 if (label.barcode_awaiting_text >= 0) {  // Element index
                     ZPL_element& bc = label.elements[label.barcode_awaiting_text];  // Element index
-                    bc.text.deepCopy(temp);
+                    bc.barcode.text = ZPL_text::of(arg);
                     bc.x = x;
                     bc.y = y;
                     bc.inverted = inverted;
@@ -1113,31 +1540,28 @@ ZPL_label* parse_zpl(const std::string* zpl_text, int debug_level = 1) {
                     label.barcode_awaiting_text = -1;  // Element index
                 } else {
                     ZPL_GET_ELEMENT();
-                    element->str = cmd_str.subtract(c);
                     element->type = cmd;
                     element->x = x;
                     element->y = y;
-                    element->text.deepCopy(temp);
+                    element->field.text = ZPL_text::of(arg);
                     element->color = color;
                     element->inverted = inverted;
-                    element->font_type = state.font_type;
-                    element->font_size = state.font_size;
+                    element->field.font_type = state.font_type;
+                    element->field.font_size = state.font_size;
                 }
                 state.reset();
             } break;
             case FX: {
                 // ^FX Demo VDA4902 Label Template
                 // Only store the text
-                ZPL_PARSE_STRING(temp, Z_OPTIONAL, WITH_DELIMITER);
+                ZPL_PARSE_STRING(arg, Z_OPTIONAL, WITH_DELIMITER);
                 ZPL_GET_ELEMENT();
-                element->str = cmd_str.subtract(c);
                 element->type = cmd;
-                element->text.deepCopy(temp);
+                element->comment.text = ZPL_text::of(arg);
             } break;
             case FS: {
                 // ^FS
                 state.reset();
-                temp[0] = 0;
             } break;
 
             case BY: {
@@ -1151,52 +1575,50 @@ ZPL_label* parse_zpl(const std::string* zpl_text, int debug_level = 1) {
                 // ^B3N,N,70,N,N^FD852934^FS
                 ZPL_GET_ELEMENT();
 
-                element->barcode_width = state.barcode_width;
-                element->barcode_height = state.barcode_height;
-                element->barcode_wn_ratio = state.barcode_wn_ratio;
+                element->barcode.width = state.barcode_width;
+                element->barcode.height = state.barcode_height;
+                element->barcode.wn_ratio = state.barcode_wn_ratio;
+                element->barcode.text = ZPL_text::of(StringView("", 0)); // Until the ^FD
 
-                element->orientation = 'N';
-                element->check = 'N';
-                element->interpretation = 'Y';
-                element->interpretation_above = 'N';
+                element->barcode.orientation = 'N';
+                element->barcode.check = 'N';
+                element->barcode.interpretation = 'Y';
+                element->barcode.interpretation_above = 'N';
 
-                ZPL_PARSE_CHAR(element->orientation, Z_OPTIONAL); // N = normal, R = rotated 90 degrees clockwise, I = inverted 180 degrees, B = bottom up 180 degrees
-                ZPL_PARSE_CHAR(element->check, Z_OPTIONAL); // N = no check digit, Y = check digit
-                ZPL_PARSE_NUMBER(element->barcode_height, Z_OPTIONAL); // Height of the barcode in dots
-                ZPL_PARSE_CHAR(element->interpretation, Z_OPTIONAL); // N = no interpretation line, Y = interpretation line
-                ZPL_PARSE_CHAR(element->interpretation_above, Z_OPTIONAL); // N = no interpretation line above the barcode, Y = interpretation line above the barcode
+                ZPL_PARSE_CHAR(element->barcode.orientation, Z_OPTIONAL); // N = normal, R = rotated 90 degrees clockwise, I = inverted 180 degrees, B = bottom up 180 degrees
+                ZPL_PARSE_CHAR(element->barcode.check, Z_OPTIONAL); // N = no check digit, Y = check digit
+                ZPL_PARSE_NUMBER(element->barcode.height, Z_OPTIONAL); // Height of the barcode in dots
+                ZPL_PARSE_CHAR(element->barcode.interpretation, Z_OPTIONAL); // N = no interpretation line, Y = interpretation line
+                ZPL_PARSE_CHAR(element->barcode.interpretation_above, Z_OPTIONAL); // N = no interpretation line above the barcode, Y = interpretation line above the barcode
 
-                element->str = cmd_str.subtract(c);
                 element->type = cmd;
-                element->barcode = true;
-                label.barcode_awaiting_text = label.length - 1; // Element index
+                label.barcode_awaiting_text = label.length() - 1; // Element index
             } break;
 
             case BC: {
                 // ^BCN,70,N,N^FD852934^FS
                 ZPL_GET_ELEMENT();
 
-                element->barcode_width = state.barcode_width;
-                element->barcode_height = state.barcode_height;
-                element->barcode_wn_ratio = state.barcode_wn_ratio;
+                element->barcode.width = state.barcode_width;
+                element->barcode.height = state.barcode_height;
+                element->barcode.wn_ratio = state.barcode_wn_ratio;
+                element->barcode.text = ZPL_text::of(StringView("", 0)); // Until the ^FD
 
-                element->orientation = 'N';
-                element->check = 'N';
-                element->interpretation = 'Y';
-                element->interpretation_above = 'N';
-                element->mode = 'N';
+                element->barcode.orientation = 'N';
+                element->barcode.check = 'N';
+                element->barcode.interpretation = 'Y';
+                element->barcode.interpretation_above = 'N';
+                element->barcode.mode = 'N';
 
-                ZPL_PARSE_CHAR(element->orientation, Z_OPTIONAL); // N = normal, R = rotated 90 degrees clockwise, I = inverted 180 degrees, B = bottom up 180 degrees
-                ZPL_PARSE_NUMBER(element->barcode_height, Z_OPTIONAL); // Height of the barcode in dots
-                ZPL_PARSE_CHAR(element->interpretation, Z_OPTIONAL); // N = no interpretation line, Y = interpretation line
-                ZPL_PARSE_CHAR(element->interpretation_above, Z_OPTIONAL); // N = no interpretation line above the barcode, Y = interpretation line above the barcode
-                ZPL_PARSE_CHAR(element->check, Z_OPTIONAL); // N = no check digit, Y = check digit
-                ZPL_PARSE_CHAR(element->mode, Z_OPTIONAL); // To be implemented
+                ZPL_PARSE_CHAR(element->barcode.orientation, Z_OPTIONAL); // N = normal, R = rotated 90 degrees clockwise, I = inverted 180 degrees, B = bottom up 180 degrees
+                ZPL_PARSE_NUMBER(element->barcode.height, Z_OPTIONAL); // Height of the barcode in dots
+                ZPL_PARSE_CHAR(element->barcode.interpretation, Z_OPTIONAL); // N = no interpretation line, Y = interpretation line
+                ZPL_PARSE_CHAR(element->barcode.interpretation_above, Z_OPTIONAL); // N = no interpretation line above the barcode, Y = interpretation line above the barcode
+                ZPL_PARSE_CHAR(element->barcode.check, Z_OPTIONAL); // N = no check digit, Y = check digit
+                ZPL_PARSE_CHAR(element->barcode.mode, Z_OPTIONAL); // To be implemented
 
-                element->str = cmd_str.subtract(c);
                 element->type = cmd;
-                element->barcode = true;
-                label.barcode_awaiting_text = label.length - 1; // Element index
+                label.barcode_awaiting_text = label.length() - 1; // Element index
             } break;
 
             case GF: {
@@ -1221,7 +1643,6 @@ ZPL_label* parse_zpl(const std::string* zpl_text, int debug_level = 1) {
                 bool is_z64 = graphic_data.startsWith(":Z64:");
 
                 if (is_z64) {
-                    element->use_halfbyte = false;
                     graphic_data.shift(5);
                     int semicolon_index = graphic_data.indexOf(':');
                     if (semicolon_index < 0) {
@@ -1230,28 +1651,26 @@ ZPL_label* parse_zpl(const std::string* zpl_text, int debug_level = 1) {
                         return &label;
                     }
                     auto z64_data = graphic_data.substring(0, semicolon_index);
-                    z64_parser.parse(byte_count, column_count, z64_data, element->bitmap, caret);
+                    z64_parser.parse(byte_count, column_count, z64_data, label.arena, element->graphic.bitmap, caret);
                     if (z64_parser.error) {
                         label.error = 1;
                         label.message = z64_parser.message;
                         label.idx = idx + z64_parser.idx;
                         return &label;
                     }
-                    element->width = z64_parser.width;
-                    element->height = z64_parser.height;
+                    element->graphic.width = z64_parser.width;
+                    element->graphic.height = z64_parser.height;
                 } else {
-                    element->use_halfbyte = true;
-                    rle_parser.parse(byte_count, column_count, graphic_data, element->bitmap, caret);
+                    rle_parser.parse(byte_count, column_count, graphic_data, label.arena, element->graphic.bitmap, caret);
                     if (rle_parser.error) {
                         label.error = 1;
                         label.message = rle_parser.message;
                         label.idx = idx + rle_parser.idx;
                         return &label;
                     }
-                    element->width = rle_parser.width;
-                    element->height = rle_parser.height;
+                    element->graphic.width = rle_parser.width / 2; // Packed into bytes
+                    element->graphic.height = rle_parser.height;
                 }
-                element->str = cmd_str.subtract(c);
                 element->type = cmd;
                 element->x = x;
                 element->y = y;
@@ -1259,65 +1678,405 @@ ZPL_label* parse_zpl(const std::string* zpl_text, int debug_level = 1) {
 
             default: {
                 ZPL_GET_ELEMENT();
-                element->str = cmd_str.subtract(c);
                 element->type = cmd;
             } break;
         }
     }
 
+    label.layout();
     return &label;
 }
 
+// Parse the whole text into the label of the context
+ZPL_label* parse_zpl(ZPL_context& context, const std::string* zpl_text, int debug_level = 1) {
+    ZPL_label& label = context.label;
+    label.clearAll();
+    StringView c = StringView(*zpl_text);
+    return parse_zpl(context, label, c, debug_level);
+}
 
 
 
+void printParseError(ZPL_label* label, const std::string* zpl_text) {
+    notifyf("Error reading ZPL: %s\n", label->message);
+    int offset = 0;
+    int row = 0;
+    std::string* line = lineAt(zpl_text, label->idx, &offset, &row);
+    if (!line) return;
+    printf("  Line %d\n", row);
+    printf("   %s\n", line->c_str());
+    printf("   %*s\n", offset, "^");
+    delete line;
+}
 
+// Parse every ^XA...^XZ label of the text on its own, in input order, into context.labels[0..count). The label objects
+// are reused between calls. Each label starts with the settings of the one before it, the first with the defaults.
+// Returns 0 on success
+int parse_zpl_labels(ZPL_context& context, const std::string& zpl_text, int& count, int debug_level = 0) {
+    std::vector<std::unique_ptr<ZPL_label>>& labels = context.labels;
+    count = 0;
+    StringView c = StringView(zpl_text);
+    const ZPL_label* previous = nullptr;
+    while (c.length()) {
+        if ((int) labels.size() <= count) labels.emplace_back(new ZPL_label());
+        ZPL_label& next = *labels[count];
+        if (previous) {
+            next.clear();
+            next.carryFrom(*previous);
+        } else {
+            next.clearAll();
+        }
+        parse_zpl(context, next, c, debug_level, true);
+        if (next.error) {
+            printParseError(&next, &zpl_text);
+            return 3;
+        }
+        if (next.length() == 0) break; // Whitespace after the last label
+        previous = &next;
+        count++;
+    }
+    return 0;
+}
 
-
-Image temp_image = Image(0, 0, WHITE);
-int zpl2png(std::string zpl_text, std::vector<uint8_t>& png_data, int width, int height, int dpi, PNG_ENCODER compression, int debug_level = 0) {
+// Write every ^XA...^XZ label in the text as a PDF page, ^PQ copies repeat the page. The document goes to the sink
+// as each page is finished, so a batch of any length never has to be held in memory. Labels are parsed on their own
+int zpl2pdf(ZPL_context& context, const std::string& zpl_text, const PngSink& sink, int width, int height, int dpi, int debug_level = 0) {
+    ZPL_label& label = context.label;
+    StopWatch& timer = context.timer;
     if (zpl_text.empty()) {
         notifyf("Empty ZPL text\n");
         return 1;
     }
-    // if (debug_level > 0) timer.start("zpl2png total");
-    if (debug_level > 0) timer.start("Parse ZPL");
-    ZPL_label* label = parse_zpl(&zpl_text, debug_level); // Decode ZPL
-    if (debug_level > 0) timer.log("Parse ZPL");
-    if (!label) {
-        notifyf("Error parsing ZPL\n");
-        return 2;
+    if (debug_level > 0) timer.start("Write PDF");
+    PdfDocument pdf(sink, dpi);
+    std::vector<unsigned char> content; // Content stream of the page being drawn
+    VectorWriter writer(pdf, content, dpi);
+    pdf.begin();
+    StringView c = StringView(zpl_text);
+    label.clearAll(); // Nothing carries over from the text before
+    while (c.length()) {
+        // One label at a time in the label of the context, clear() keeps the settings the next label carries over
+        label.clear();
+        parse_zpl(context, label, c, debug_level, true);
+        if (label.error) {
+            printParseError(&label, &zpl_text);
+            return 3;
+        }
+        if (label.length() == 0) break; // Whitespace after the last label
+        if (debug_level > 1) label.print();
+        label.drawVector(writer, width, height);
+        if (pdf.page(content, writer.width, writer.height, label.copies)) return 4;
     }
-    if (label->error) {
-        notifyf("Error reading ZPL: %s\n", label->message);
-        int offset = 0;
-        int row = 0;
-        std::string* line = lineAt(&zpl_text, label->idx, &offset, &row);
-        printf("  Line %d\n", row);
-        printf("   %s\n", line->c_str());
-        printf("   %*s\n", offset, "^");
-        return 3;
+    if (pdf.end()) return 4;
+    if (debug_level > 0) timer.log("Write PDF");
+    return 0;
+}
+
+// Render a parsed label into image_data in the given format, other than PDF. The label is drawn on canvas, whose format
+// sets the color depth, and PNG output is compressed by encoder. Returns 0 on success
+int zpl_render(ZPL_context& context, ZPL_label* label, Image& canvas, PngEncoder& encoder, std::vector<uint8_t>& image_data, int width, int height, int dpi, OUTPUT_FORMAT output, PNG_ENCODER compression, int debug_level = 0) {
+    StopWatch& timer = context.timer;
+    label->threads = context.threads;
+    if (output == OF_PNG && compression == PE_FPNG && canvas.format == IF_MONO) {
+        // Fast mode renders and deflates at the same time, the PNG is appended to image_data chunk by chunk
+        if (debug_level > 0) timer.start("Render and compress ZPL to PNG");
+        image_data.clear();
+        PngSink sink = [&](const unsigned char* data, size_t size) { image_data.insert(image_data.end(), data, data + size); };
+        if (label->drawStreamed(width, height, encoder, sink)) {
+            notifyf("Error converting image to PNG\n");
+            return 4;
+        }
+        if (debug_level > 0) timer.log("Render and compress ZPL to PNG");
+        return 0;
+    }
+    if (output == OF_SVG || output == OF_EPS) {
+        if (debug_level > 0) timer.start("Write vector image");
+        VectorWriter writer(output, image_data, dpi);
+        label->drawVector(writer, width, height);
+        if (debug_level > 0) timer.log("Write vector image");
+        return 0;
     }
-    if (debug_level > 1) label->print();
     if (debug_level > 0) timer.start("Render ZPL to image");
-    temp_image.resize(width, height, WHITE);
-    label->draw(temp_image); // Render ZPL to image
+    canvas.resize(width, height, WHITE);
+    label->draw(canvas); // Render ZPL to image
     if (debug_level > 0) timer.log("Render ZPL to image");
+    if (output != OF_PNG) {
+        // Raw formats are copied straight from the raster, TIFF is coded from its runs
+        if (debug_level > 0) timer.start("Write image");
+        if (canvas.toRaster(output, image_data, dpi)) return 4;
+        if (debug_level > 0) timer.log("Write image");
+        return 0;
+    }
     if (debug_level > 0) timer.start("Compress image to PNG");
-    // std::vector<unsigned char>* png = image.toPNG(PE_LODEPNG); // Slower but better compression
-    // std::vector<unsigned char>* png = image.toPNG(PE_FPNG); // Faster but less compression
-    std::vector<unsigned char>* png = temp_image.toPNG(compression); // Compress the image to PNG
-    if (png == nullptr) {
+    // PE_LODEPNG is slower but compresses better, PE_FPNG is faster
+    if (canvas.toPNG(compression, image_data, encoder)) { // Compress the image to PNG straight into the caller's buffer
         notifyf("Error converting image to PNG\n");
         return 4;
     }
-    if (png->empty()) {
+    if (image_data.empty()) {
         notifyf("Empty PNG data\n");
         return 5;
     }
     if (debug_level > 0) timer.log("Compress image to PNG");
-    png_data.clear();
-    png_data.insert(png_data.end(), png->begin(), png->end()); // Copy the PNG data to the output vector
-    // if (debug_level > 0) timer.log("zpl2png total");
+    if (debug_level > 1 && compression == PE_AUTO && canvas.format != IF_RGBA) {
+        PngAutoPlan& plan = encoder.auto_plan;
+        printf("Auto PNG: %d rows sampled, %d blank, %d repeated, runs of %d px -> %s filter, level %d, strategy %d\n",
+            plan.rows, plan.blank_rows, plan.repeated_rows, plan.run_length, plan.filter_up ? "Up" : "None", plan.level, plan.strategy);
+    }
     return 0;
+}
+
+// Render ZPL into an image file in the given format, compression only applies to PNG. Only the first label of the text
+// is rendered, zpl2images renders each of them. PDF output takes every label as a page
+int zpl2image(ZPL_context& context, std::string zpl_text, std::vector<uint8_t>& image_data, int width, int height, int dpi, OUTPUT_FORMAT output, PNG_ENCODER compression, int debug_level = 0) {
+    StopWatch& timer = context.timer;
+    if (zpl_text.empty()) {
+        notifyf("Empty ZPL text\n");
+        return 1;
+    }
+    if (output == OF_PDF) {
+        image_data.clear();
+        return zpl2pdf(context, zpl_text, [&](const unsigned char* data, size_t size) { image_data.insert(image_data.end(), data, data + size); }, width, height, dpi, debug_level);
+    }
+    // if (debug_level > 0) timer.start("zpl2png total");
+    int count = 0;
+    if (debug_level > 0) timer.start("Parse ZPL");
+    int error = parse_zpl_labels(context, zpl_text, count, debug_level); // Decode ZPL
+    if (debug_level > 0) timer.log("Parse ZPL");
+    if (error) return error;
+    if (count == 0) {
+        notifyf("No labels in ZPL text\n");
+        return 2;
+    }
+    if (count > 1 && debug_level > 0) printf("Label 1 of %d rendered, zpl2images renders each of them\n", count);
+    ZPL_label* label = context.labels[0].get();
+    if (debug_level > 1) label->print();
+    return zpl_render(context, label, context.image, context.png, image_data, width, height, dpi, output, compression, debug_level);
+}
+
+// Render every label of the text into its own image, images[i] for the i-th label in input order. A single label is
+// rendered like zpl2image, split into bands over the thread pool. Several labels are spread over the pool one label
+// per job instead, each worker with its own canvas and encoder set up like those of the context. PDF output is one
+// document with a page per label in images[0]. Returns 0 on success
+int zpl2images(ZPL_context& context, const std::string& zpl_text, std::vector<std::vector<uint8_t>>& images, int width, int height, int dpi, OUTPUT_FORMAT output, PNG_ENCODER compression, int debug_level = 0) {
+    if (zpl_text.empty()) {
+        notifyf("Empty ZPL text\n");
+        return 1;
+    }
+    if (output == OF_PDF) {
+        images.resize(1);
+        return zpl2image(context, zpl_text, images[0], width, height, dpi, output, compression, debug_level);
+    }
+    StopWatch& timer = context.timer;
+    std::vector<std::unique_ptr<ZPL_label>>& labels = context.labels;
+    int count = 0;
+    if (debug_level > 0) timer.start("Parse ZPL");
+    int error = parse_zpl_labels(context, zpl_text, count, debug_level);
+    if (debug_level > 0) timer.log("Parse ZPL");
+    if (error) return error;
+    if (count == 0) {
+        notifyf("No labels in ZPL text\n");
+        return 2;
+    }
+    images.resize(count);
+    if (debug_level > 1) {
+        for (int i = 0; i < count; i++) labels[i]->print();
+    }
+    if (count == 1) return zpl_render(context, labels[0].get(), context.image, context.png, images[0], width, height, dpi, output, compression, debug_level);
+
+    std::vector<std::unique_ptr<ZPL_render_slot>>& slots = context.slots;
+    int workers = std::min(context.threads > 0 ? context.threads : thread_pool.size(), count);
+    while ((int) slots.size() < workers) slots.emplace_back(new ZPL_render_slot());
+    for (int w = 0; w < workers; w++) {
+        slots[w]->canvas.setFormat(context.image.format);
+        slots[w]->encoder.copySettings(context.png);
+    }
+    std::vector<int> errors(count, 0);
+    std::atomic<int> next(0);
+    if (debug_level > 0) timer.start("Render labels");
+    // The timer of the context is not shared between threads, so the jobs render without debug output
+    thread_pool.run(workers, [&](int w) {
+        ZPL_render_slot& slot = *slots[w];
+        for (int i = next++; i < count; i = next++) {
+            errors[i] = zpl_render(context, labels[i].get(), slot.canvas, slot.encoder, images[i], width, height, dpi, output, compression, 0);
+        }
+    });
+    if (debug_level > 0) timer.log("Render labels");
+    for (int i = 0; i < count; i++) {
+        if (errors[i]) return errors[i];
+    }
+    return 0;
+}
+
+// ZPL received in chunks as they arrive, from a pipe or a socket. Every label is parsed and handed on the moment its
+// ^XZ arrives, while the rest of the stream may still be on its way. Only the label being received is buffered, so an
+// endless stream needs no more memory than its largest label, ^GF data included
+class ZPL_stream {
+public:
+    // Gets every label in the label of the context, valid until the next one. A non zero return stops the stream
+    typedef std::function<int(ZPL_label&)> LabelHandler;
+
+    ZPL_stream(ZPL_context& context, const LabelHandler& handler, int debug_level = 0)
+        : context(context), handler(handler), debug_level(debug_level) {
+        context.label.clearAll(); // Settings carry over between the labels of the stream, not from before it
+    }
+
+    // Add the next chunk of the stream, any labels it completes are handed on before it returns. Returns 0 on success
+    int feed(const char* data, size_t size) {
+        buffer.append(data, size);
+        size_t start = 0;
+        for (size_t end = labelEnd(start); end > 0; end = labelEnd(start)) {
+            size_t used = 0;
+            int error = emit(start, end, false, used);
+            if (error) return error;
+            if (used == 0) continue; // The parser reads the ^XZ found as part of the label, wait for the next one
+            start += used;
+            if (start != scanned) {
+                // The parser ended the label before the ^XZ found, scan again from there
+                scanned = start;
+                caret = '^';
+            }
+        }
+        // Drop the labels handed on, the scan goes on where it stopped
+        buffer.erase(0, start);
+        scanned -= start;
+        return 0;
+    }
+
+    // The stream is closed, commands after the last ^XZ still make a label. Returns 0 on success
+    int finish() {
+        int error = 0;
+        for (size_t start = 0, used = 0; start < buffer.size() && !error; start += used) {
+            error = emit(start, buffer.size(), true, used);
+            if (used == 0) break;
+        }
+        buffer.clear();
+        scanned = 0;
+        caret = '^';
+        return error;
+    }
+
+    // Labels handed on so far
+    int count() const {
+        return labels;
+    }
+
+private:
+    ZPL_context& context;
+    LabelHandler handler;
+    int debug_level;
+    std::string buffer; // Rest of the label being received
+    size_t scanned = 0; // Bytes of the buffer known to hold no ^XZ
+    char caret = '^'; // Caret in effect at scanned, the parser starts every label with the default one
+    int labels = 0;
+
+    // Where the label starting at start would end, just past its ^XZ, or 0 when no ^XZ has arrived yet. The parser
+    // has the last word, this only saves parsing the label again for every chunk
+    size_t labelEnd(size_t start) {
+        if (scanned < start) scanned = start;
+        for (; scanned + 2 < buffer.size(); scanned++) {
+            if (buffer[scanned] != caret) continue;
+            if (buffer[scanned + 1] == 'X' && buffer[scanned + 2] == 'Z') {
+                scanned += 3;
+                caret = '^';
+                return scanned;
+            }
+            if (buffer[scanned + 1] == 'C' && buffer[scanned + 2] == 'C') {
+                if (scanned + 3 >= buffer.size()) break; // The new caret is in the next chunk
+                caret = buffer[scanned + 3];
+                scanned += 3;
+            }
+        }
+        return 0;
+    }
+
+    // Parse one label from buffer[start, end) and hand it on, text without any commands is skipped. used is set to the
+    // bytes the label takes, 0 when it has not ended by end and more of the stream is needed, unless this is the last
+    // of it. Returns 0 on success
+    int emit(size_t start, size_t end, bool last, size_t& used) {
+        ZPL_label& label = context.label;
+        label.clear();
+        StringView c = StringView(buffer.data() + start, end - start);
+        parse_zpl(context, label, c, debug_level, true);
+        used = 0;
+        if (label.error) {
+            std::string text = buffer.substr(start, end - start);
+            printParseError(&label, &text);
+            return 3;
+        }
+        bool ended = label.length() > 0 && label.elements.back().type == XZ;
+        if (!ended && !last) return 0;
+        used = c.offset();
+        if (label.length() == 0) return 0;
+        if (debug_level > 1) label.print();
+        labels++;
+        return handler(label);
+    }
+};
+
+int zpl2png(ZPL_context& context, std::string zpl_text, std::vector<uint8_t>& png_data, int width, int height, int dpi, PNG_ENCODER compression, int debug_level = 0) {
+    return zpl2image(context, zpl_text, png_data, width, height, dpi, OF_PNG, compression, debug_level);
+}
+
+// Render the first label once and compare the PNG encoders and deflate backends on it, printing size and time per
+// configuration
+int zpl_benchmark(ZPL_context& context, std::string zpl_text, int width, int height, int runs = 5) {
+    Image& canvas = context.image;
+    PngEncoder& png = context.png;
+    StopWatch& timer = context.timer;
+    int count = 0;
+    if (parse_zpl_labels(context, zpl_text, count, 0) || count == 0) {
+        notifyf("Error parsing ZPL\n");
+        return 2;
+    }
+    if (count > 1) printf("Label 1 of %d\n", count);
+    ZPL_label* label = context.labels[0].get();
+    label->threads = context.threads;
+    canvas.resize(width, height, WHITE);
+    label->draw(canvas);
+    if (runs < 1) runs = 1;
+
+    struct Config {
+        const char* name;
+        PNG_ENCODER encoder;
+        PNG_DEFLATE backend;
+        int level;
+        int strategy;
+        int effort;
+    };
+    const Config configs[] = {
+        { "lodepng", PE_LODEPNG, PD_LODEPNG, 0, 0, 0 },
+        { "zlib 9", PE_LODEPNG, PD_ZLIB, Z_BEST_COMPRESSION, Z_DEFAULT_STRATEGY, 0 },
+        { "zlib 9 filtered", PE_LODEPNG, PD_ZLIB, Z_BEST_COMPRESSION, Z_FILTERED, 0 },
+        { "zlib 9 rle", PE_LODEPNG, PD_ZLIB, Z_BEST_COMPRESSION, Z_RLE, 0 },
+        { "zlib 6", PE_LODEPNG, PD_ZLIB, 6, Z_DEFAULT_STRATEGY, 0 },
+        { "zlib 1", PE_LODEPNG, PD_ZLIB, Z_BEST_SPEED, Z_DEFAULT_STRATEGY, 0 },
+        { "fast", PE_FPNG, PD_LODEPNG, 0, 0, 0 },
+        { "auto 3", PE_AUTO, PD_LODEPNG, 0, 0, 3 },
+        { "auto 6", PE_AUTO, PD_LODEPNG, 0, 0, 6 },
+        { "auto 9", PE_AUTO, PD_LODEPNG, 0, 0, 9 },
+    };
+    PNG_DEFLATE backend = png.deflate_backend;
+    int level = png.zlib_level;
+    int strategy = png.zlib_strategy;
+    int effort = png.auto_effort;
+    std::vector<uint8_t> png_data;
+    int error = 0;
+    printf("%-16s %10s %10s\n", "Backend", "Bytes", "ms");
+    for (const Config& config : configs) {
+        png.deflate_backend = config.backend;
+        png.zlib_level = config.level;
+        png.zlib_strategy = config.strategy;
+        png.auto_effort = config.effort;
+        timer.start("Benchmark");
+        for (int i = 0; i < runs && !error; i++) error = canvas.toPNG(config.encoder, png_data, png);
+        double elapsed = timer.time("Benchmark");
+        if (error) break;
+        printf("%-16s %10d %10.2f\n", config.name, (int) png_data.size(), elapsed * 1000.0 / runs);
+    }
+    png.deflate_backend = backend;
+    png.zlib_level = level;
+    png.zlib_strategy = strategy;
+    png.auto_effort = effort;
+    return error ? 4 : 0;
 }
\ No newline at end of file
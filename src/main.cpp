@@ -10,13 +10,19 @@ typedef vector<string> string_array;
 int main(int arg_c, char** arg_v) {
     hide_console();
 
+    ZPL_context context; // Every file is converted in this one context
+    StopWatch& timer = context.timer;
+
     PNG_ENCODER png_mode = PE_LODEPNG; // smaller PNG size
+    OUTPUT_FORMAT output_format = OF_PNG;
     bool test_reuse = false;
     bool silent = false;
     bool loud = false;
     bool debug = false;
     bool print_memory = false;
     bool streamBase64 = false;
+    bool benchmark = false;
+    int benchmark_runs = 5;
     string target = "";
     int num_of_tests = 15;
     for (int arg_i = 1; arg_i < arg_c; arg_i++) {
@@ -30,6 +36,33 @@ int main(int arg_c, char** arg_v) {
             png_mode = PE_LODEPNG; // smaller PNG size
             continue;
         }
+        if (arg == "-a") {
+            png_mode = PE_AUTO; // pick the PNG settings per label
+            // Parse effort
+            if (arg_i + 1 < arg_c) {
+                int effort = atoi(arg_v[arg_i + 1]);
+                if (effort >= 1 && effort <= 9) {
+                    context.png.auto_effort = effort;
+                    arg_i++;
+                }
+            }
+            continue;
+        }
+        if (arg == "-o") {
+            // Parse output format
+            if (arg_i + 1 < arg_c) {
+                output_format = outputFormat(arg_v[++arg_i]);
+                if (output_format == OF_UNKNOWN) {
+                    notifyf("Unknown output format: %s\n", arg_v[arg_i]);
+                    return 1;
+                }
+            }
+            continue;
+        }
+        if (arg == "-r") {
+            context.image.setFormat(IF_RLE); // draw into run lists instead of a bitmap
+            continue;
+        }
         if (arg == "-m") {
             print_memory = true; // print memory usage (for debugging)
             continue;
@@ -60,6 +93,47 @@ int main(int arg_c, char** arg_v) {
             }
             continue;
         }
+        if (arg == "-z") {
+            // Deflate backend for small PNG encoding
+            if (arg_i + 1 < arg_c) {
+                string backend = arg_v[++arg_i];
+                context.png.deflate_backend = backend == "lodepng" ? PD_LODEPNG : PD_ZLIB;
+                if (backend == "rle") context.png.zlib_strategy = Z_RLE;
+                else if (backend == "filtered") context.png.zlib_strategy = Z_FILTERED;
+                else context.png.zlib_strategy = Z_DEFAULT_STRATEGY;
+            }
+            continue;
+        }
+        if (arg == "-l") {
+            // Parse zlib compression level
+            if (arg_i + 1 < arg_c) {
+                int level = atoi(arg_v[++arg_i]);
+                context.png.zlib_level = level < 0 ? 0 : level > 9 ? 9 : level;
+            }
+            continue;
+        }
+        if (arg == "-bench") {
+            benchmark = true; // compare the PNG encoders instead of converting
+            // Parse number of runs
+            if (arg_i + 1 < arg_c) {
+                int runs = atoi(arg_v[arg_i + 1]);
+                if (runs > 0) {
+                    benchmark_runs = runs;
+                    arg_i++;
+                }
+            }
+            continue;
+        }
+        if (arg == "-j") {
+            // Parse number of render threads
+            if (arg_i + 1 < arg_c) {
+                context.threads = atoi(arg_v[arg_i + 1]);
+                if (context.threads < 0) context.threads = 0;
+                context.png.threads = context.threads;
+                arg_i++;
+            }
+            continue;
+        }
         // Handle "<file>" for input without '-' prefix
         if (target.empty() && arg[0] != '-') {
             target = arg;
@@ -71,8 +145,8 @@ int main(int arg_c, char** arg_v) {
 
     notifications_enabled = loud;
 
-    string pipe_data = getPipe();
-    bool got_pipe = !pipe_data.empty();
+    PipeReader pipe;
+    bool got_pipe = pipe.next(); // Waits for the first chunk
 
     if (got_pipe || streamBase64) {
         silent = true;
@@ -83,12 +157,19 @@ int main(int arg_c, char** arg_v) {
         if (!silent) {
             notify("No ZPL file specified\n");
             printf("Usage: zpl2png <file> [-f] [-s] [-b] [silent] [loud]\n");
-            printf("  <file>  ZPL file to convert to PNG\n");
+            printf("  <file>  ZPL file to convert to PNG, a file with several labels gives <file>_1.png, <file>_2.png, ...\n");
             printf("  -f         Use fast PNG encoding (default is small PNG size)\n");
             printf("  -s         Use small PNG size (default is fast PNG encoding)\n");
-            printf("  -b         Stream PNG data as base64\n");
+            printf("  -a [1-9]   Pick the PNG settings per label, 1 is fastest and 9 smallest (default is 6)\n");
+            printf("  -o <fmt>   Output format: png (default), tiff (Group 4), uncompressed pbm, pgm or bmp, a zpl ^GF label, or vector svg, eps or pdf (a page per label)\n");
+            printf("  -r         Render into run lists, memory follows the label content instead of its size\n");
+            printf("  -b         Stream PNG data as base64, a line per label\n");
             printf("  -m         Print memory usage (for debugging)\n");
             printf("  -t [num]   Run multiple times for testing\n");
+            printf("  -j [num]   Number of render and compression threads (default is one per core)\n");
+            printf("  -z <name>  Deflate for small PNG size: lodepng (default), zlib, rle or filtered\n");
+            printf("  -l <num>   zlib compression level 0-9 (default is 9)\n");
+            printf("  -bench [n] Compare PNG encoders on each file, n runs each (default is 5)\n");
             printf("  debug      Enable debug output\n");
             printf("  silent     No stdout output\n");
             printf("  loud       Enable pop-up notifications\n");
@@ -96,6 +177,59 @@ int main(int arg_c, char** arg_v) {
         return 1;
     }
 
+    const int width = 1800;
+    const int height = 1200;
+
+    if (got_pipe) {
+        // Every label is converted and printed as a base64 line the moment its ^XZ arrives, while the rest of the
+        // input is still being read. PDF is one base64 line, each page printed as it is finished
+        byte_array output;
+        unsigned char pdf_tail[3]; // Bytes of the PDF not printed yet, base64 goes out in groups of 3
+        size_t pdf_tail_length = 0;
+        PdfDocument pdf([&](const unsigned char* data, size_t bytes) {
+            if (pdf_tail_length) {
+                while (bytes && pdf_tail_length < 3) {
+                    pdf_tail[pdf_tail_length++] = *data++;
+                    bytes--;
+                }
+                if (pdf_tail_length < 3) return;
+                fputs(b64encode(pdf_tail, 3).c_str(), stdout);
+                pdf_tail_length = 0;
+            }
+            size_t whole = bytes - bytes % 3;
+            if (whole) fputs(b64encode(data, whole).c_str(), stdout);
+            for (size_t i = whole; i < bytes; i++) pdf_tail[pdf_tail_length++] = data[i];
+        });
+        vector<unsigned char> content; // Content stream of the page being drawn
+        VectorWriter writer(pdf, content);
+        if (output_format == OF_PDF) pdf.begin();
+        ZPL_stream stream(context, [&](ZPL_label& label) {
+            if (output_format == OF_PDF) {
+                label.drawVector(writer, width, height);
+                int error = pdf.page(content, writer.width, writer.height, label.copies);
+                fflush(stdout);
+                return error;
+            }
+            if (zpl_render(context, &label, context.image, context.png, output, width, height, 0, output_format, png_mode)) return 4;
+            string line = b64encode(output.data(), output.size());
+            printf("%s\n", line.c_str());
+            fflush(stdout);
+            return 0;
+        });
+        int error = 0;
+        do error = stream.feed(pipe.data(), pipe.length); while (!error && pipe.next());
+        if (!error) error = stream.finish();
+        if (!error && stream.count() == 0) {
+            notifyf("No labels in ZPL text\n");
+            error = 1;
+        }
+        if (!error && output_format == OF_PDF) {
+            error = pdf.end();
+            if (!error) printf("%s\n", b64encode(pdf_tail, pdf_tail_length).c_str());
+        }
+        return error ? 2 : 0;
+    }
+
     // Get file path and file name
     string zpl_file = "";
     string directory = "";
@@ -126,30 +260,48 @@ int main(int arg_c, char** arg_v) {
 
 
     for (string file : files) {
-        string png_file = file.substr(0, file.find_last_of('.')) + ".png";
+        string png_file = file.substr(0, file.find_last_of('.')) + outputExtension(output_format);
         if (!silent) printf("Converting %s\n", file.c_str());
 
         timer.start("Total");
         string zpl_input;
         size_t size = 0;
         // timer.start("Loaded");
-        if (got_file && !got_pipe) {
-            const char* zpl_raw = loadFile(file.c_str());
-            if (!zpl_raw) {
-                notifyf("Failed to load ZPL file: %s\n", (file).c_str());
-                return 1;
-            }
-            zpl_input = zpl_raw;
-            // timer.log("Loaded");
-        } else if (got_pipe) {
-            zpl_input = pipe_data.c_str();
+        const char* zpl_raw = loadFile(file.c_str());
+        if (!zpl_raw) {
+            notifyf("Failed to load ZPL file: %s\n", (file).c_str());
+            return 1;
         }
+        zpl_input = zpl_raw;
+        free((void*) zpl_raw);
+        // timer.log("Loaded");
 
+        if (benchmark) {
+            if (zpl_benchmark(context, zpl_input, width, height, benchmark_runs)) return 2;
+            continue;
+        }
 
-        const int width = 1800;
-        const int height = 1200;
+        if (output_format == OF_PDF && got_file && !streamBase64 && !test_reuse) {
+            // Pages are written to the file as they are finished
+            FILE* pdf_file = fopen(png_file.c_str(), "wb");
+            if (!pdf_file) {
+                notifyf("Failed to write %s\n", png_file.c_str());
+                return 1;
+            }
+            int debug_level = !print_memory && !silent ? 1 : 0;
+            if (debug) debug_level = 2;
+            int error = zpl2pdf(context, zpl_input, [&](const unsigned char* data, size_t bytes) {
+                size += fwrite(data, 1, bytes, pdf_file);
+            }, width, height, 0, debug_level);
+            fclose(pdf_file);
+            if (error) return 2;
+            if (print_memory) printHeapUsage();
+            double total = timer.time("Total");
+            if (!silent) printf("Total time: %.1f ms for %d bytes\n", total * 1000.0, (int) size);
+            continue;
+        }
 
-        byte_array png_output;
+        vector<byte_array> images; // One per label in input order
         if (print_memory) printHeapUsage();
 
         for (int i = 0; i < num_of_tests; i++) {
@@ -158,21 +310,30 @@ int main(int arg_c, char** arg_v) {
             timer.start("Total_2");
             int debug_level = !print_memory && !silent ? 1 : 0;
             if (debug) debug_level = 2;
-            int error = zpl2png(zpl_input, png_output, width, height, 0, png_mode, debug_level); // Faster but less compression
+            int error = zpl2images(context, zpl_input, images, width, height, 0, output_format, png_mode, debug_level);
 
             if (error) return 2;
             
 
-            // Save to a file with the same name as the ZPL file but with a PNG extension
-            if (got_file && !streamBase64) {
-                saveFile(png_file.c_str(), (const char*) png_output.data(), png_output.size());
-            }
-            if (streamBase64) {
-                // printf("PNG data: %d bytes\n", png_output.size());
-                string png_base64 = b64encode(png_output.data(), png_output.size());
-                printf("%s\n", png_base64.c_str());
+            // Save to a file with the same name as the ZPL file but with a PNG extension, numbered from 1 when the
+            // file holds several labels
+            size = 0;
+            for (size_t n = 0; n < images.size(); n++) {
+                byte_array& png_output = images[n];
+                if (got_file && !streamBase64) {
+                    string image_file = png_file;
+                    if (images.size() > 1) {
+                        image_file = file.substr(0, file.find_last_of('.')) + "_" + to_string(n + 1) + outputExtension(output_format);
+                    }
+                    saveFile(image_file.c_str(), (const char*) png_output.data(), png_output.size());
+                }
+                if (streamBase64) {
+                    // One line per label
+                    string png_base64 = b64encode(png_output.data(), png_output.size());
+                    printf("%s\n", png_base64.c_str());
+                }
+                size += png_output.size();
             }
-            size = png_output.size();
             double saved = timer.time("Total_2");
             if (!print_memory && test_reuse && !silent) printf("Total time: %.1f ms for %d bytes\n", saved * 1000.0, size);
             if (print_memory) printHeapUsage();